@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+
+#include "my3status.h"
+
+/*
+ * Update budgets. Every module gets a token bucket, refilled at `rate` tokens
+ * a second up to `burst`, and each output costs a token. Modules in the
+ * immediate class trigger a frame straight away while they have tokens left;
+ * anything else waits for the next scheduled frame.
+ *
+ * MY3STATUS_BUDGETS="pulse=20/5,inoitems=2/4,*=10/5" sets rate/burst per
+ * module, "*" being the default. MY3STATUS_IMMEDIATE="clock,pulse" lists the
+ * immediate class.
+ */
+#define DEFAULT_RATE 10
+#define DEFAULT_BURST 5
+#define DEFAULT_IMMEDIATE "clock,pulse"
+
+#define MAX_BUDGETS 32
+#define BUDGET_NAME_MAX 32
+
+struct budget {
+	char	name[BUDGET_NAME_MAX];
+	double	rate;
+	double	burst;
+};
+
+static struct budget budgets[MAX_BUDGETS];
+static int budget_count;
+
+static struct budget default_budget = {
+	.name = "*", .rate = DEFAULT_RATE, .burst = DEFAULT_BURST
+};
+
+static const char *immediate = DEFAULT_IMMEDIATE;
+
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+static void load_config();
+static void parse_budget(char *);
+static bool in_list(const char *, const char *);
+
+/*
+ * Called with output_mutex held, when the module registers.
+ */
+void my3status_budget_init(struct my3status_module *m)
+{
+	pthread_once(&config_once, load_config);
+
+	const struct budget *b = &default_budget;
+	for (int i = 0; i < budget_count; i += 1) {
+		if (strcmp(budgets[i].name, m->name) == 0) {
+			b = &budgets[i];
+			break;
+		}
+	}
+
+	m->immediate = in_list(immediate, m->name);
+	m->rate = b->rate;
+	m->burst = b->burst;
+	m->tokens = b->burst;
+	m->refilled_at = my3status_now_ms();
+}
+
+/*
+ * Called with output_mutex held, for every output. Returns true if the
+ * module may trigger a frame now; otherwise the update is left for the next
+ * scheduled frame.
+ */
+bool my3status_budget_take(struct my3status_module *m)
+{
+	int64_t now = my3status_now_ms();
+
+	m->tokens += m->rate * (now - m->refilled_at) / 1000.0;
+	if (m->tokens > m->burst) {
+		m->tokens = m->burst;
+	}
+
+	m->refilled_at = now;
+
+	bool allowed = (m->tokens >= 1.0);
+	if (allowed) {
+		m->tokens -= 1.0;
+	} else {
+		atomic_fetch_add_explicit(&m->throttled, 1,
+					  memory_order_relaxed);
+	}
+
+	if (allowed && m->immediate) {
+		return true;
+	}
+
+	// the main loop only looks at the clock for deferred updates if it
+	// knows there are any; the first one tells it
+	if (!atomic_exchange_explicit(&m->state->deferred, true,
+				      memory_order_acq_rel))
+	{
+		pthread_kill(m->state->main_thread, SIGUSR2);
+	}
+
+	return false;
+}
+
+/*
+ * How long the main loop may sleep before the next scheduled frame, capped at
+ * `max_ms`. A scheduled frame is due MY3STATUS_FRAME_INTERVAL_MS after the
+ * last render, if anything was deferred since.
+ */
+int my3status_frame_timeout(struct my3status_state *state, int max_ms)
+{
+	if (!atomic_load_explicit(&state->deferred, memory_order_acquire)) {
+		return max_ms;
+	}
+
+	int64_t wait = state->rendered_at + MY3STATUS_FRAME_INTERVAL_MS
+		     - my3status_now_ms();
+
+	if (wait < 0) {
+		return 0;
+	}
+
+	return wait < max_ms ? (int) wait : max_ms;
+}
+
+bool my3status_frame_due(struct my3status_state *state)
+{
+	return atomic_load_explicit(&state->deferred, memory_order_acquire) &&
+	       my3status_now_ms() - state->rendered_at
+			>= MY3STATUS_FRAME_INTERVAL_MS;
+}
+
+static void load_config()
+{
+	const char *env = getenv("MY3STATUS_IMMEDIATE");
+	if (env != NULL) {
+		immediate = env;
+	}
+
+	env = getenv("MY3STATUS_BUDGETS");
+	if (env == NULL) {
+		return;
+	}
+
+	char *copy = strdup(env);
+	if (copy == NULL) {
+		error(1, errno, "strdup");
+	}
+
+	char *saveptr;
+	for (char *item = strtok_r(copy, ",", &saveptr);
+	     item != NULL;
+	     item = strtok_r(NULL, ",", &saveptr))
+	{
+		parse_budget(item);
+	}
+
+	free(copy);
+}
+
+/*
+ * NAME=RATE/BURST, where RATE is in updates per second.
+ */
+static void parse_budget(char *item)
+{
+	char *eq = strchr(item, '=');
+	if (eq == NULL || eq == item || eq - item >= BUDGET_NAME_MAX) {
+		error(0, 0, "budgets: malformed entry: %s", item);
+		return;
+	}
+
+	*eq = '\0';
+
+	char *end;
+	double rate = strtod(eq + 1, &end);
+	double burst = rate;
+
+	if (*end == '/') {
+		burst = strtod(end + 1, &end);
+	}
+
+	if (*end != '\0' || rate <= 0 || burst < 1) {
+		error(0, 0, "budgets: malformed budget for %s", item);
+		return;
+	}
+
+	struct budget *b = &default_budget;
+	if (strcmp(item, "*") != 0) {
+		if (budget_count == MAX_BUDGETS) {
+			error(0, 0, "budgets: too many entries, ignoring %s",
+			      item);
+			return;
+		}
+
+		b = &budgets[budget_count++];
+		strcpy(b->name, item);
+	}
+
+	b->rate = rate;
+	b->burst = burst;
+}
+
+static bool in_list(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+
+	for (const char *p = list; *p != '\0'; ) {
+		const char *comma = strchrnul(p, ',');
+
+		if ((size_t) (comma - p) == len && strncmp(p, name, len) == 0) {
+			return true;
+		}
+
+		p = (*comma == ',') ? comma + 1 : comma;
+	}
+
+	return false;
+}
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <time.h>
+#include "my3status.h"
+
+/*
+ * The last frame is kept on disk so that the next run can show it straight
+ * away, while the modules are still starting up. One `name\toutput` line per
+ * visible module.
+ */
+#define CACHE_DIR "my3status"
+#define CACHE_FILE "last-frame"
+
+#define CACHE_MAX 64
+#define CACHE_LINE_MAX 1024
+
+// outputs don't change much, so there's no point in writing more often
+#define SAVE_INTERVAL 60
+
+struct entry {
+	char	*name;
+	char	*output;
+};
+
+static struct entry entries[CACHE_MAX];
+static int entry_count;
+
+static char *cache_path(bool);
+static time_t monotonic_now();
+static void write_entry(FILE *, struct my3status_module *);
+
+void my3status_cache_load()
+{
+	char *path = cache_path(false);
+	if (path == NULL) {
+		return;
+	}
+
+	FILE *f = fopen(path, "re");
+	free(path);
+
+	if (f == NULL) {
+		return;
+	}
+
+	char buf[CACHE_LINE_MAX];
+	while (entry_count < CACHE_MAX && fgets(buf, sizeof(buf), f) != NULL) {
+		char *nl = strchr(buf, '\n');
+		char *tab = strchr(buf, '\t');
+		if (nl == NULL || tab == NULL) {
+			continue;
+		}
+
+		*nl = '\0';
+		*tab = '\0';
+
+		struct entry *e = &entries[entry_count];
+		e->name = strdup(buf);
+		e->output = strdup(tab + 1);
+		if (e->name == NULL || e->output == NULL) {
+			error(1, errno, "strdup");
+		}
+
+		entry_count += 1;
+	}
+
+	fclose(f);
+}
+
+const char *my3status_cache_lookup(const char *name)
+{
+	for (int i = 0; i < entry_count; i += 1) {
+		if (strcmp(entries[i].name, name) == 0) {
+			return entries[i].output;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Writes the current frame out, at most every SAVE_INTERVAL seconds. The file
+ * is replaced atomically, so a crash never leaves half a frame behind.
+ */
+void my3status_cache_save(struct my3status_state *state)
+{
+	static time_t saved_at;
+
+	time_t now = monotonic_now();
+	if (saved_at == 0) {
+		// nothing worth saving while modules are still starting up
+		saved_at = now;
+		return;
+	}
+
+	if (now - saved_at < SAVE_INTERVAL) {
+		return;
+	}
+
+	saved_at = now;
+
+	char *path = cache_path(true);
+	if (path == NULL) {
+		return;
+	}
+
+	char *tmp_path;
+	if (asprintf(&tmp_path, "%s.tmp", path) == -1) {
+		error(1, errno, "asprintf");
+	}
+
+	FILE *f = fopen(tmp_path, "we");
+	if (f == NULL) {
+		error(0, errno, "can't save last frame: %s", tmp_path);
+		goto out;
+	}
+
+	bool locked = my3status_lock_modules(state);
+
+	for (unsigned i = 0; i < state->order_count; i += 1) {
+		write_entry(f, &state->modules[state->order[i]]);
+	}
+
+	my3status_unlock_modules(state, locked);
+
+	if (fclose(f) == EOF) {
+		error(0, errno, "can't save last frame: %s", tmp_path);
+		unlink(tmp_path);
+		goto out;
+	}
+
+	if (rename(tmp_path, path) == -1) {
+		error(0, errno, "can't save last frame: %s", path);
+		unlink(tmp_path);
+	}
+
+out:
+	free(tmp_path);
+	free(path);
+}
+
+/*
+ * Works from the renderer's copy of the output, so a stalled module can't
+ * hold this up.
+ */
+static void write_entry(FILE *f, struct my3status_module *m)
+{
+	const char *output = m->last_output.data;
+
+	if (m->last_visible && output != NULL &&
+	    strpbrk(output, "\t\n") == NULL)
+	{
+		fprintf(f, "%s\t%s\n", m->name, output);
+	}
+}
+
+/*
+ * $XDG_CACHE_HOME/my3status/last-frame, falling back to ~/.cache. Returns
+ * NULL if there's nowhere to put it.
+ */
+static char *cache_path(bool create)
+{
+	char *dir;
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+
+	int r;
+	if (cache_home != NULL && cache_home[0] != '\0') {
+		r = asprintf(&dir, "%s/" CACHE_DIR, cache_home);
+	} else if (home != NULL) {
+		r = asprintf(&dir, "%s/.cache/" CACHE_DIR, home);
+	} else {
+		return NULL;
+	}
+
+	if (r == -1) {
+		error(1, errno, "asprintf");
+	}
+
+	if (create && mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		error(0, errno, "can't save last frame: %s", dir);
+		free(dir);
+		return NULL;
+	}
+
+	char *path;
+	if (asprintf(&path, "%s/" CACHE_FILE, dir) == -1) {
+		error(1, errno, "asprintf");
+	}
+
+	free(dir);
+	return path;
+}
+
+static time_t monotonic_now()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		error(1, errno, "clock_gettime");
+	}
+
+	return ts.tv_sec;
+}
@@ -0,0 +1,655 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "my3status.h"
+
+#define DAEMON_SOCKET "my3status"
+#define DAEMON_LOCK "my3status.lock"
+#define MAX_CLIENTS 16
+#define REQUEST_MAX 1024
+#define FRAME_MAX 65536
+
+// how long a --persist client waits for the daemon it started
+#define PERSIST_WAIT_MS 2000
+
+// how long modules no bar asks for any more are kept, so bars reattaching one
+// by one after an i3 restart don't stop each other's modules
+#define PERSIST_GRACE_MS 10000
+
+struct client {
+	int		 fd;
+	bool		 ready;
+	bool		 persist;	/* its modules have to be running */
+	bool		 pending;	/* asked for modules still starting */
+	uint64_t	 mask;
+	char		 request[REQUEST_MAX];
+};
+
+static struct client clients[MAX_CLIENTS];
+static int client_count;
+
+// what --persist clients asked for that couldn't be started yet, and when
+// to drop modules none of them asks for
+static bool grow_wanted;
+static int64_t trim_at;
+
+static struct my3status_buf line;
+
+// held from checking for a daemon until ours is listening
+static int lock_fd = -1;
+
+static int client_connect();
+static int client_relay(int, const char *, int, char **);
+static void socket_path(struct sockaddr_un *);
+static void lock_startup();
+static void unlock_startup();
+static int listen_socket();
+static void accept_client(int);
+static void drop_client(int);
+static void read_request(struct my3status_state *, int);
+static void parse_request(struct my3status_state *, struct client *);
+static void sync_modules(struct my3status_state *, bool);
+static int add_names(char **, int, char *);
+static void resolve_requests(struct my3status_state *);
+static int serve_timeout(struct my3status_state *);
+static void send_frame(struct my3status_state *, struct client *);
+static void send_line(struct client *);
+static void broadcast(struct my3status_state *);
+
+void my3status_serve(struct my3status_state *state, int sfd)
+{
+	int lfd = listen_socket();
+
+	struct pollfd pollfds[2 + MAX_CLIENTS];
+
+	my3status_render_fragments(state);
+
+	while (1) {
+		pollfds[0] = (struct pollfd) { .fd = sfd, .events = POLLIN };
+		pollfds[1] = (struct pollfd) { .fd = lfd, .events = POLLIN };
+
+		for (int i = 0; i < client_count; i += 1) {
+			pollfds[2 + i] = (struct pollfd) {
+				.fd = clients[i].fd, .events = POLLIN
+			};
+		}
+
+		int nfds = 2 + client_count;
+		int r = poll(pollfds, nfds, serve_timeout(state));
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			error(1, errno, "poll");
+		}
+
+		// walk backwards so dropping a client doesn't shift the ones
+		// we haven't looked at yet
+		for (int i = nfds - 3; i >= 0; i -= 1) {
+			if (pollfds[2 + i].revents != 0) {
+				read_request(state, i);
+			}
+		}
+
+		if (pollfds[1].revents & POLLIN) {
+			accept_client(lfd);
+		}
+
+		bool render = false;
+		if (r > 0 && (pollfds[0].revents & POLLIN)) {
+			render = my3status_wait_for_signals(sfd, -1);
+
+			if (my3status_handle_sighup(state)) {
+				resolve_requests(state);
+			}
+		}
+
+		// modules asked for while others were starting
+		if (grow_wanted && atomic_load(&state->frozen)) {
+			sync_modules(state, false);
+		}
+
+		if (trim_at != 0 && my3status_now_ms() >= trim_at) {
+			sync_modules(state, true);
+		}
+
+		render |= my3status_frame_due(state);
+		render |= my3status_watchdog(state);
+
+		if (render) {
+			my3status_render_fragments(state);
+			broadcast(state);
+			my3status_cache_save(state);
+		}
+	}
+}
+
+static int serve_timeout(struct my3status_state *state)
+{
+	int timeout = my3status_frame_timeout(
+		state, MY3STATUS_WATCHDOG_INTERVAL_MS
+	);
+
+	if (trim_at != 0) {
+		int64_t until_trim = trim_at - my3status_now_ms();
+		if (until_trim < timeout) {
+			timeout = until_trim > 0 ? until_trim : 0;
+		}
+	}
+
+	return timeout;
+}
+
+int my3status_client_run(int argc, char **argv)
+{
+	int fd = client_connect();
+	if (fd == -1) {
+		error(1, errno, "can't reach daemon");
+	}
+
+	return client_relay(fd, NULL, argc, argv);
+}
+
+/*
+ * Reattaches to the daemon of an earlier run, telling it which modules to
+ * show now; see read_request(). If there isn't one, forks one off in its own
+ * session so it outlives this process and i3bar, and relays its output. Only
+ * returns in that daemon.
+ *
+ * Bars usually start together, one per output, so this runs under the
+ * startup lock: the others wait for the first one's daemon to listen, and
+ * then reattach to it.
+ */
+void my3status_persist(int argc, char **argv)
+{
+	lock_startup();
+
+	int fd = client_connect();
+	if (fd != -1) {
+		unlock_startup();
+		exit(client_relay(fd, "reload", argc, argv));
+	}
+
+	if (errno != ENOENT && errno != ECONNREFUSED) {
+		error(1, errno, "can't reach daemon");
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		error(1, errno, "fork");
+	}
+
+	if (pid == 0) {
+		if (setsid() == -1) {
+			error(1, errno, "setsid");
+		}
+
+		// i3bar is waiting for EOF on the pipe, not on us
+		int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+		if (null == -1 || dup2(null, 0) == -1 || dup2(null, 1) == -1) {
+			error(1, errno, "can't detach from i3bar");
+		}
+
+		close(null);
+
+		// the lock is passed on, listen_socket() lets go of it
+		return;
+	}
+
+	unlock_startup();
+
+	for (int waited = 0; waited < PERSIST_WAIT_MS; waited += 10) {
+		fd = client_connect();
+		if (fd != -1) {
+			exit(client_relay(fd, "reload", argc, argv));
+		}
+
+		usleep(10 * 1000);
+	}
+
+	error(1, errno, "daemon didn't come up");
+}
+
+static int client_connect()
+{
+	struct sockaddr_un addr;
+	socket_path(&addr);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		error(1, errno, "socket");
+	}
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Sends the request, optionally prefixed with a verb, and copies frames to
+ * stdout until the daemon goes away.
+ */
+static int client_relay(int fd, const char *verb, int argc, char **argv)
+{
+	char request[REQUEST_MAX];
+	size_t len = 0;
+
+	if (verb != NULL) {
+		len = snprintf(request, REQUEST_MAX, "%s ", verb);
+	}
+
+	for (int i = 0; i < argc; i += 1) {
+		int n = snprintf(request + len, REQUEST_MAX - len, "%s%s",
+				 i == 0 ? "" : " ", argv[i]);
+
+		if (n < 0 || (size_t) n >= REQUEST_MAX - len - 1) {
+			error(1, 0, "too many modules requested");
+		}
+
+		len += n;
+	}
+
+	request[len++] = '\n';
+
+	if (send(fd, request, len, MSG_NOSIGNAL) == -1) {
+		error(1, errno, "send");
+	}
+
+	printf("{\"version\":1}\n"
+	       "[\n");
+
+	static char frame[FRAME_MAX];
+
+	while (1) {
+		ssize_t n = recv(fd, frame, FRAME_MAX, 0);
+		if (n == -1) {
+			error(1, errno, "recv");
+		}
+
+		if (n == 0) {
+			error(1, 0, "daemon went away");
+		}
+
+		fwrite(frame, 1, n, stdout);
+
+		if (fflush(stdout) == EOF) {
+			error(1, errno, "fflush");
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static void socket_path(struct sockaddr_un *addr)
+{
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir == NULL) {
+		PANIC(0, "XDG_RUNTIME_DIR not set");
+	}
+
+	*addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+
+	int len = snprintf(addr->sun_path, sizeof(addr->sun_path),
+			   "%s/" DAEMON_SOCKET, runtime_dir);
+	if (len < 0 || (size_t) len >= sizeof(addr->sun_path)) {
+		PANIC(0, "socket path too long");
+	}
+}
+
+/*
+ * Serialises daemon startup, so two daemons can't both decide there's none
+ * running yet.
+ */
+static void lock_startup()
+{
+	if (lock_fd != -1) {
+		return;
+	}
+
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir == NULL) {
+		PANIC(0, "XDG_RUNTIME_DIR not set");
+	}
+
+	char *path;
+	if (asprintf(&path, "%s/" DAEMON_LOCK, runtime_dir) == -1) {
+		PANIC(errno, "asprintf");
+	}
+
+	lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lock_fd == -1) {
+		PANIC(errno, "can't open %s", path);
+	}
+
+	while (flock(lock_fd, LOCK_EX) == -1) {
+		if (errno != EINTR) {
+			PANIC(errno, "flock failed: %s", path);
+		}
+	}
+
+	free(path);
+}
+
+static void unlock_startup()
+{
+	if (lock_fd != -1) {
+		close(lock_fd);
+		lock_fd = -1;
+	}
+}
+
+static int listen_socket()
+{
+	struct sockaddr_un addr;
+	socket_path(&addr);
+
+	lock_startup();
+
+	// only a socket nobody answers on is left over from a dead daemon
+	int running = client_connect();
+	if (running != -1) {
+		PANIC(0, "a daemon is already running at %s", addr.sun_path);
+	}
+
+	if (errno == ECONNREFUSED && unlink(addr.sun_path) == -1 &&
+	    errno != ENOENT)
+	{
+		PANIC(errno, "unlink failed: %s", addr.sun_path);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		PANIC(errno, "socket");
+	}
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		PANIC(errno, "bind failed: %s", addr.sun_path);
+	}
+
+	if (listen(fd, MAX_CLIENTS) == -1) {
+		PANIC(errno, "listen");
+	}
+
+	unlock_startup();
+
+	return fd;
+}
+
+static void accept_client(int lfd)
+{
+	int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd == -1) {
+		error(0, errno, "accept");
+		return;
+	}
+
+	if (client_count == MAX_CLIENTS) {
+		error(0, 0, "too many clients, turning one away");
+		close(fd);
+		return;
+	}
+
+	clients[client_count++] = (struct client) { .fd = fd };
+}
+
+static void drop_client(int i)
+{
+	close(clients[i].fd);
+	clients[i] = clients[--client_count];
+}
+
+/*
+ * The only thing a client ever sends is its request: a line of module
+ * names to show, or an empty line for all of them. Anything after that
+ * means it hung up.
+ *
+ * `--persist` clients prefix theirs with "reload", and the modules they
+ * name are started if they aren't running yet. Every bar sees only its own
+ * modules, so bars with different lists can share the daemon. Modules that
+ * no attached bar names any more are stopped PERSIST_GRACE_MS after the
+ * last bar attached, unless no bar or a --client is attached.
+ */
+static void read_request(struct my3status_state *state, int i)
+{
+	struct client *c = &clients[i];
+
+	ssize_t n = recv(c->fd, c->request, REQUEST_MAX - 1, 0);
+	if (n <= 0 || c->ready) {
+		drop_client(i);
+		return;
+	}
+
+	c->request[n] = '\0';
+	c->ready = true;
+
+	if (strncmp(c->request, "reload ", 7) == 0) {
+		memmove(c->request, c->request + 7, n - 7 + 1);
+		c->persist = true;
+
+		// the first frame has to show the new modules already
+		sync_modules(state, false);
+		trim_at = my3status_now_ms() + PERSIST_GRACE_MS;
+	}
+
+	parse_request(state, c);
+
+	send_frame(state, c);
+}
+
+/*
+ * Clients can connect while modules are still starting. Names that haven't
+ * registered yet leave the client pending, and it's looked at again once
+ * the registry is frozen; only then are they unknown.
+ */
+static void parse_request(struct my3status_state *state, struct client *c)
+{
+	char request[REQUEST_MAX];
+	strcpy(request, c->request);
+
+	bool frozen = atomic_load(&state->frozen);
+	bool named = false;
+	uint64_t mask = 0;
+	char *saveptr;
+
+	c->pending = false;
+
+	for (char *name = strtok_r(request, " \n", &saveptr);
+	     name != NULL;
+	     name = strtok_r(NULL, " \n", &saveptr))
+	{
+		named = true;
+
+		// --persist clients name plugins by file
+		size_t len = strlen(name);
+		if (len > 3 && strcmp(name + len - 3, ".so") == 0) {
+			name[len - 3] = '\0';
+		}
+
+		struct my3status_module *m = my3status_find_module(state, name);
+		if (m == NULL && !frozen) {
+			c->pending = true;
+			continue;
+		}
+
+		if (m == NULL) {
+			error(0, 0, "client requested unknown module: %s", name);
+			continue;
+		}
+
+		mask |= UINT64_C(1) << m->index;
+	}
+
+	c->mask = named ? mask : MY3STATUS_ALL_MODULES;
+}
+
+/*
+ * Runs the modules --persist clients ask for. Without `trim`, only adds the
+ * ones that aren't running yet; with it, also drops the ones none of them
+ * asks for.
+ */
+static void sync_modules(struct my3status_state *state, bool trim)
+{
+	char *names[MY3STATUS_MAX_MODULES];
+	char *current[MY3STATUS_MAX_MODULES];
+	char requests[MAX_CLIENTS][REQUEST_MAX];
+	bool attached = false;
+
+	int current_count = my3status_module_list(current);
+	int count = trim ? 0 : current_count;
+	memcpy(names, current, count * sizeof(char *));
+
+	if (trim) {
+		trim_at = 0;
+	}
+
+	for (int i = 0; i < client_count; i += 1) {
+		struct client *c = &clients[i];
+		if (!c->ready) {
+			continue;
+		}
+
+		// --client users don't say what has to keep running
+		if (!c->persist && trim) {
+			return;
+		}
+
+		if (c->persist) {
+			strcpy(requests[i], c->request);
+			count = add_names(names, count, requests[i]);
+			attached = true;
+		}
+	}
+
+	if (!attached || count == 0) {
+		return;
+	}
+
+	if (count == current_count) {
+		bool same = true;
+		for (int i = 0; i < count && same; i += 1) {
+			same = (strcmp(names[i], current[i]) == 0);
+		}
+
+		if (same) {
+			grow_wanted = false;
+			return;
+		}
+	}
+
+	if (my3status_reload(state, count, names) == 0) {
+		grow_wanted = false;
+		resolve_requests(state);
+		my3status_render_fragments(state);
+	} else if (errno == EBUSY && trim) {
+		trim_at = my3status_now_ms() + MY3STATUS_WATCHDOG_INTERVAL_MS;
+	} else if (errno == EBUSY) {
+		grow_wanted = true;
+	}
+}
+
+/*
+ * Adds the names in `request` that `names` doesn't have yet, as many times
+ * as the request lists them. Tokenises `request` in place, and the names
+ * added point into it.
+ */
+static int add_names(char **names, int count, char *request)
+{
+	char *saveptr;
+	char *seen[MY3STATUS_MAX_MODULES];
+	int seen_count = 0;
+
+	for (char *name = strtok_r(request, " \n", &saveptr);
+	     name != NULL && seen_count < MY3STATUS_MAX_MODULES;
+	     name = strtok_r(NULL, " \n", &saveptr))
+	{
+		seen[seen_count++] = name;
+
+		int wanted = 0;
+		for (int i = 0; i < seen_count; i += 1) {
+			wanted += (strcmp(seen[i], name) == 0);
+		}
+
+		int have = 0;
+		for (int i = 0; i < count; i += 1) {
+			have += (strcmp(names[i], name) == 0);
+		}
+
+		if (have >= wanted || count == MY3STATUS_MAX_MODULES) {
+			continue;
+		}
+
+		names[count++] = name;
+	}
+
+	return count;
+}
+
+/*
+ * A reload can hand a stopped module's place, and with it its bit in client
+ * masks, to another module, so requests are looked up again.
+ */
+static void resolve_requests(struct my3status_state *state)
+{
+	for (int i = 0; i < client_count; i += 1) {
+		struct client *c = &clients[i];
+
+		if (c->ready) {
+			parse_request(state, c);
+		}
+	}
+}
+
+static void send_frame(struct my3status_state *state, struct client *c)
+{
+	my3status_render_line(state, c->mask, &line);
+	send_line(c);
+}
+
+static void send_line(struct client *c)
+{
+	// a client that can't keep up misses this frame; the next one is a
+	// complete status line anyway. any other error gets the client
+	// dropped once poll() reports the hangup.
+	if (send(c->fd, line.data, line.len, MSG_NOSIGNAL) == -1 &&
+	    errno != EAGAIN)
+	{
+		c->ready = false;
+		shutdown(c->fd, SHUT_RDWR);
+	}
+}
+
+static void broadcast(struct my3status_state *state)
+{
+	uint64_t rendered_mask = 0;
+	bool rendered = false;
+
+	for (int i = 0; i < client_count; i += 1) {
+		struct client *c = &clients[i];
+		if (!c->ready) {
+			continue;
+		}
+
+		if (c->pending && atomic_load(&state->frozen)) {
+			parse_request(state, c);
+		}
+
+		// clients showing the same modules share one line
+		if (!rendered || c->mask != rendered_mask) {
+			my3status_render_line(state, c->mask, &line);
+			rendered_mask = c->mask;
+			rendered = true;
+		}
+
+		send_line(c);
+	}
+}
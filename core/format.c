@@ -0,0 +1,424 @@
+#include <ctype.h>
+#include "my3status.h"
+
+#define STRING_MAX 128
+
+enum op_kind {
+	OP_LITERAL,
+	OP_FIELD,
+};
+
+struct op {
+	enum op_kind	 kind;
+
+	// OP_LITERAL
+	const char	*literal;
+	size_t		 literal_len;
+
+	// OP_FIELD
+	size_t		 field;
+
+	// where this op's output started on the previous render
+	size_t		 offset;
+};
+
+struct my3status_format {
+	const struct my3status_format_field	*fields;
+	size_t					 field_count;
+
+	char					*source;
+	struct op				*ops;
+	size_t					 op_count;
+
+	bool					 rendered;
+	union my3status_format_value		*previous;
+	char					(*previous_strings)[STRING_MAX];
+};
+
+static const char DIGIT_PAIRS[200] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const char *format_source(const char *, const char *);
+static size_t find_field(const struct my3status_format *, const char *,
+			 size_t);
+static void add_op(struct my3status_format *, struct op);
+static bool field_changed(const struct my3status_format *, size_t,
+			  const union my3status_format_value *);
+static size_t first_changed_op(const struct my3status_format *,
+			       const union my3status_format_value *);
+static size_t render_op(const struct my3status_format *, const struct op *,
+			const union my3status_format_value *, char *, size_t);
+static size_t render_uint(uint64_t, int, char *);
+static size_t render_fixed(int64_t, int, char *);
+static size_t render_duration(int64_t, char *);
+
+struct my3status_format *my3status_format_compile(
+	const char				*module_name,
+	const char				*default_format,
+	const struct my3status_format_field	*fields,
+	size_t					 field_count
+) {
+	struct my3status_format *f = calloc(1, sizeof(*f));
+	if (f == NULL) {
+		error(1, errno, "calloc");
+	}
+
+	f->fields = fields;
+	f->field_count = field_count;
+
+	f->previous = calloc(field_count, sizeof(*f->previous));
+	f->previous_strings = calloc(field_count, STRING_MAX);
+	f->source = strdup(format_source(module_name, default_format));
+
+	if (f->previous == NULL || f->previous_strings == NULL ||
+	    f->source == NULL)
+	{
+		error(1, errno, "calloc");
+	}
+
+	char *p = f->source;
+	char *literal = p;
+
+	while (*p != '\0') {
+		if (*p != '{' && *p != '}') {
+			p += 1;
+			continue;
+		}
+
+		// "{{" and "}}" are literal braces
+		if (p[1] == *p) {
+			add_op(f, (struct op) {
+				.kind = OP_LITERAL,
+				.literal = literal,
+				.literal_len = p + 1 - literal
+			});
+
+			p += 2;
+			literal = p;
+			continue;
+		}
+
+		if (*p == '}') {
+			p += 1;
+			continue;
+		}
+
+		char *end = strchr(p, '}');
+		if (end == NULL) {
+			error(1, 0, "%s: unterminated field in format: %s",
+			      module_name, f->source);
+		}
+
+		if (p > literal) {
+			add_op(f, (struct op) {
+				.kind = OP_LITERAL,
+				.literal = literal,
+				.literal_len = p - literal
+			});
+		}
+
+		add_op(f, (struct op) {
+			.kind = OP_FIELD,
+			.field = find_field(f, p + 1, end - p - 1)
+		});
+
+		p = end + 1;
+		literal = p;
+	}
+
+	if (p > literal) {
+		add_op(f, (struct op) {
+			.kind = OP_LITERAL,
+			.literal = literal,
+			.literal_len = p - literal
+		});
+	}
+
+	return f;
+}
+
+bool my3status_format_changed(
+	const struct my3status_format		*f,
+	const union my3status_format_value	*values
+) {
+	return first_changed_op(f, values) < f->op_count;
+}
+
+size_t my3status_format_render(
+	struct my3status_format			*f,
+	const union my3status_format_value	*values,
+	char					*out,
+	size_t					 size
+) {
+	size_t first = first_changed_op(f, values);
+	if (first == f->op_count) {
+		return 0;
+	}
+
+	// everything before the first changed field is still in place
+	size_t pos = (first == 0 ? 0 : f->ops[first].offset);
+
+	for (size_t i = first; i < f->op_count; i += 1) {
+		f->ops[i].offset = pos;
+		pos += render_op(f, &f->ops[i], values, out + pos, size - pos);
+	}
+
+	out[pos] = '\0';
+
+	for (size_t i = 0; i < f->field_count; i += 1) {
+		if (f->fields[i].type == MY3STATUS_FORMAT_STRING) {
+			snprintf(f->previous_strings[i], STRING_MAX, "%s",
+				 values[i].s);
+		} else {
+			f->previous[i] = values[i];
+		}
+	}
+
+	f->rendered = true;
+
+	return pos;
+}
+
+/*
+ * Users can override a module's format with MY3STATUS_FORMAT_<MODULE>.
+ */
+static const char *format_source(
+	const char *module_name,
+	const char *default_format
+) {
+	char var[64] = "MY3STATUS_FORMAT_";
+	size_t len = strlen(var);
+
+	for (const char *c = module_name; *c != '\0' && len < 63; c += 1) {
+		var[len++] = toupper((unsigned char) *c);
+	}
+
+	var[len] = '\0';
+
+	const char *s = getenv(var);
+	return s != NULL ? s : default_format;
+}
+
+static size_t find_field(
+	const struct my3status_format	*f,
+	const char			*name,
+	size_t				 len
+) {
+	for (size_t i = 0; i < f->field_count; i += 1) {
+		if (strncmp(f->fields[i].name, name, len) == 0 &&
+		    f->fields[i].name[len] == '\0')
+		{
+			return i;
+		}
+	}
+
+	error(1, 0, "unknown field in format: %.*s", (int) len, name);
+	return 0;
+}
+
+static void add_op(struct my3status_format *f, struct op op)
+{
+	struct op *ops = realloc(f->ops, (f->op_count + 1) * sizeof(*ops));
+	if (ops == NULL) {
+		error(1, errno, "realloc");
+	}
+
+	ops[f->op_count++] = op;
+	f->ops = ops;
+}
+
+static bool field_changed(
+	const struct my3status_format		*f,
+	size_t					 field,
+	const union my3status_format_value	*values
+) {
+	if (f->fields[field].type == MY3STATUS_FORMAT_STRING) {
+		return strncmp(f->previous_strings[field], values[field].s,
+			       STRING_MAX - 1) != 0;
+	}
+
+	return f->previous[field].i != values[field].i;
+}
+
+static size_t first_changed_op(
+	const struct my3status_format		*f,
+	const union my3status_format_value	*values
+) {
+	if (!f->rendered) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < f->op_count; i += 1) {
+		if (f->ops[i].kind == OP_FIELD &&
+		    field_changed(f, f->ops[i].field, values))
+		{
+			return i;
+		}
+	}
+
+	return f->op_count;
+}
+
+static size_t render_op(
+	const struct my3status_format		*f,
+	const struct op				*op,
+	const union my3status_format_value	*values,
+	char					*out,
+	size_t					 size
+) {
+	// big enough for any number we render
+	char buf[32];
+	const char *s = buf;
+	size_t len;
+
+	if (size <= 1) {
+		return 0;
+	}
+
+	if (op->kind == OP_LITERAL) {
+		s = op->literal;
+		len = op->literal_len;
+		goto copy;
+	}
+
+	const struct my3status_format_field *field = &f->fields[op->field];
+	union my3status_format_value v = values[op->field];
+
+	switch (field->type) {
+	case MY3STATUS_FORMAT_INT:
+		len = render_fixed(v.i, 0, buf);
+		break;
+
+	case MY3STATUS_FORMAT_FIXED:
+		len = render_fixed(v.i, field->decimals, buf);
+		break;
+
+	case MY3STATUS_FORMAT_PERCENT:
+		len = render_fixed(v.i, 0, buf);
+		buf[len++] = '%';
+		break;
+
+	case MY3STATUS_FORMAT_DURATION:
+		len = render_duration(v.i, buf);
+		break;
+
+	case MY3STATUS_FORMAT_GLYPH:
+		if (v.i < 0 || (size_t) v.i >= field->glyph_count) {
+			return 0;
+		}
+
+		s = field->glyphs[v.i];
+		len = strlen(s);
+		break;
+
+	case MY3STATUS_FORMAT_STRING:
+		s = v.s;
+		len = strlen(s);
+		break;
+
+	default:
+		return 0;
+	}
+
+copy:
+	if (len > size - 1) {
+		len = size - 1;
+	}
+
+	memcpy(out, s, len);
+	return len;
+}
+
+/*
+ * Writes `v` zero-padded to at least `min_digits` digits, two digits at a
+ * time.
+ */
+static size_t render_uint(uint64_t v, int min_digits, char *out)
+{
+	char buf[20];
+	char *p = buf + sizeof(buf);
+
+	while (v >= 100) {
+		p -= 2;
+		memcpy(p, &DIGIT_PAIRS[(v % 100) * 2], 2);
+		v /= 100;
+	}
+
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, &DIGIT_PAIRS[v * 2], 2);
+	} else {
+		*--p = '0' + v;
+	}
+
+	while (buf + sizeof(buf) - p < min_digits) {
+		*--p = '0';
+	}
+
+	size_t len = buf + sizeof(buf) - p;
+	memcpy(out, p, len);
+
+	return len;
+}
+
+/*
+ * Renders `v / 10^decimals` with exactly `decimals` digits after the point.
+ */
+static size_t render_fixed(int64_t v, int decimals, char *out)
+{
+	size_t len = 0;
+	uint64_t u = v;
+
+	if (v < 0) {
+		out[len++] = '-';
+		u = -(uint64_t) v;
+	}
+
+	if (decimals == 0) {
+		return len + render_uint(u, 1, out + len);
+	}
+
+	uint64_t scale = 1;
+	for (int i = 0; i < decimals; i += 1) {
+		scale *= 10;
+	}
+
+	len += render_uint(u / scale, 1, out + len);
+	out[len++] = '.';
+	len += render_uint(u % scale, decimals, out + len);
+
+	return len;
+}
+
+/*
+ * Seconds as "H:MM" below a day, whole days above.
+ */
+static size_t render_duration(int64_t seconds, char *out)
+{
+	size_t len;
+
+	if (seconds < 0) {
+		seconds = 0;
+	}
+
+	if (seconds >= 86400) {
+		len = render_uint(seconds / 86400, 1, out);
+		out[len++] = 'd';
+		return len;
+	}
+
+	len = render_uint(seconds / 3600, 1, out);
+	out[len++] = ':';
+	len += render_uint((seconds % 3600) / 60, 2, out + len);
+
+	return len;
+}
@@ -1,5 +1,6 @@
 #include <dlfcn.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/signalfd.h>
 
 #include "my3status.h"
@@ -9,13 +10,83 @@
 #define MY3STATUS_MODULE_PREFIX ""
 #endif
 
+// how long the first frame waits for modules that are quick to start
+#define FIRST_FRAME_TIMEOUT_MS 20
+
+/*
+ * Built-in modules are either linked in or, if they'd drag heavy libraries
+ * into every process, built as plugins and only loaded when asked for.
+ */
+struct builtin {
+	const char	*name;
+	int		(*init)(struct my3status_state *);
+	const char	*plugin;
+};
+
+static const struct builtin builtins[] = {
+	{ .name = "clock",	.init = mod_clock_init },
+	{ .name = "df",		.init = mod_df_init },
+	{ .name = "inoitems",	.init = mod_inoitems_init },
+	{ .name = "meds",	.plugin = "meds.so" },
+	{ .name = "net",	.init = mod_net_init },
+	{ .name = "power",	.init = mod_power_init },
+	{ .name = "pulse",	.plugin = "pulse.so" },
+	{ .name = "sockitems",	.init = mod_sockitems_init },
+	{ .name = "sysinfo",	.init = mod_sysinfo_init },
+};
+
+/*
+ * One start of a module, from the command line or a reload. A reload keeps
+ * the instances it lists again, and with them their threads and
+ * connections. The ones it drops are stopped and their numbers reused;
+ * modules that can't be stopped just leave the bar, ready to come back if a
+ * later reload lists them again. Free numbers have no `arg`.
+ */
+struct instance {
+	char	*arg;
+	bool	 active;
+	int	 slot;
+};
+
+static struct instance instances[MY3STATUS_MAX_MODULES];
+static unsigned instance_count;
+
+/*
+ * Modules start concurrently, so a slow one (pulse waiting for the server,
+ * imap doing a TLS handshake) doesn't hold up the first frame.
+ */
+struct pending_init {
+	struct my3status_state	*state;
+	unsigned		 instance;
+	unsigned		 slot;
+	const char		*name;
+	const struct builtin	*builtin;
+};
+
+static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t init_cond = PTHREAD_COND_INITIALIZER;
+static unsigned inits_pending;
+
+static bool sighup_received;
+
 static int parse_args(int, char **, struct my3status_state *);
+static int apply_modules(struct my3status_state *, int, char **);
+static bool check_module(const char *);
+static int find_instance(const char *, const int *);
+static int free_instance();
+static void module_name(const char *, char *, size_t);
+static const struct builtin *find_builtin(const char *);
+static void register_placeholder(struct my3status_state *, unsigned,
+				 unsigned, const char *);
+static void start_init(struct my3status_state *, unsigned, unsigned,
+		       const char *, const struct builtin *);
+static void *run_init(void *);
+static void wait_for_inits(unsigned);
 
 static int load_external_module(struct my3status_state *, const char *);
 static char *generate_module_path(const char *);
 
-static int listen_sigusr1();
-static void wait_for_signals(int);
+static int listen_signals();
 
 int main(int argc, char **argv)
 {
@@ -24,58 +95,104 @@ int main(int argc, char **argv)
 		error(1, errno, "setenv");
 	}
 
+	// `my3status --client [module...]` relays a daemon's output to i3bar
+	if (argc > 1 && strcmp("--client", argv[1]) == 0) {
+		return my3status_client_run(argc - 2, argv + 2);
+	}
+
+	// `my3status --persist module...` hands the modules to the daemon of
+	// an earlier run and relays its output, starting the daemon first if
+	// there isn't one; only that daemon gets past this
+	bool persist = (argc > 1 && strcmp("--persist", argv[1]) == 0);
+	if (persist) {
+		my3status_persist(argc - 2, argv + 2);
+	}
+
+	// `my3status --daemon module...` runs the modules for many clients
+	bool daemon_mode = persist ||
+			   (argc > 1 && strcmp("--daemon", argv[1]) == 0);
+	if (daemon_mode) {
+		argc -= 1;
+		argv += 1;
+	}
+
 	struct my3status_state state = {
-		.main_thread = pthread_self()
+		.main_thread = pthread_self(),
+		.modules_mutex = PTHREAD_MUTEX_INITIALIZER,
+		.modules_cond = PTHREAD_COND_INITIALIZER
 	};
 
-	int sfd = listen_sigusr1();
+	int sfd = listen_signals();
+
+	// `my3status --replay trace [speed]` benchmarks the core on a trace
+	if (argc > 1 && strcmp("--replay", argv[1]) == 0) {
+		return my3status_replay_run(&state, sfd, argc - 2, argv + 2);
+	}
+
+	my3status_trace_start();
+
+	if (my3status_shm_create() == -1) {
+		error(0, errno, "not publishing to shared memory");
+	}
+
+	my3status_cache_load();
 
 	if (parse_args(argc, argv, &state) == -1) {
 		exit(EXIT_FAILURE);
 	}
 
+	// give the quick modules a moment, but don't wait for the slow ones
+	wait_for_inits(FIRST_FRAME_TIMEOUT_MS);
+
+	if (daemon_mode) {
+		my3status_serve(&state, sfd);
+	}
+
 	printf("{\"version\":1}\n"
 	       "[\n");
 
-	struct my3status_module_node	*n;
-	struct my3status_module		*m;
-	const char			*module_end;
+	struct my3status_buf line = { 0 };
+	bool render = true;
 
 	while (1) {
-		wait_for_signals(sfd);
-
-		fputs("[", stdout);
+		if (render) {
+			my3status_render_fragments(&state);
+			my3status_render_line(&state, MY3STATUS_ALL_MODULES,
+					      &line);
 
-		n = state.first_module;
-		while (n != NULL) {
-			m = n->module;
-			module_end = (n->next == NULL ? "" : ",");
+			fwrite(line.data, 1, line.len, stdout);
 
-			pthread_mutex_lock(&m->output_mutex);
-			if (m->output_visible) {
-				printf(
-					"{\"name\":\"%s\",\"full_text\":\"%s\"}%s",
-					m->name, m->output, module_end
-				);
+			if (fflush(stdout) == EOF) {
+				error(1, errno, "fflush");
 			}
-			pthread_mutex_unlock(&m->output_mutex);
 
-			n = n->next;
+			my3status_cache_save(&state);
 		}
 
-		fputs("],\n", stdout);
+		// wake up for deferred updates, and now and then even if
+		// nothing happens, so stalled modules get noticed
+		int timeout = my3status_frame_timeout(
+			&state, MY3STATUS_WATCHDOG_INTERVAL_MS
+		);
 
-		if (fflush(stdout) == EOF) {
-			error(1, errno, "fflush");
-		}
+		render = my3status_wait_for_signals(sfd, timeout);
+		my3status_handle_sighup(&state);
+		render |= my3status_frame_due(&state);
+		render |= my3status_watchdog(&state);
 	}
 }
 
-static int listen_sigusr1()
+/*
+ * SIGUSR1 means a module has new output, SIGUSR2 that one has deferred some
+ * for the next scheduled frame, SIGHUP asks for a reload.
+ */
+static int listen_signals()
 {
 	sigset_t mask;
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGHUP);
 
 	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
 		error(1, errno, "sigprocmask");
@@ -99,27 +216,413 @@ static int parse_args(int argc, char **argv, struct my3status_state *state)
 		return -1;
 	}
 
-	int r = 0;
-	for (int i = 1; i < argc; ++i) {
-		if (strcmp("clock", argv[i]) == 0) {
-			mod_clock_init(state);
-		} else if (strcmp("df", argv[i]) == 0) {
-			mod_df_init(state);
-		} else if (strcmp("meds", argv[i]) == 0) {
-			mod_meds_init(state);
-		} else if (strcmp("pulse", argv[i]) == 0) {
-			mod_pulse_init(state);
-		} else if (strcmp("sysinfo", argv[i]) == 0) {
-			mod_sysinfo_init(state);
-		} else if (strcmp("inoitems", argv[i]) == 0) {
-			mod_inoitems_init(state);
-		} else if (load_external_module(state, argv[i]) == -1) {
-			fprintf(stderr, "invalid module: %s\n", argv[i]);
-			r = -1;
+	return apply_modules(state, argc - 1, argv + 1);
+}
+
+/*
+ * Switches the bar over to a new module list, keeping every module it lists
+ * again and stopping the rest. New modules start in the background like at
+ * startup; the rest is visible with the next frame.
+ */
+int my3status_reload(struct my3status_state *state, int count, char **names)
+{
+	pthread_mutex_lock(&init_mutex);
+	bool starting = (inits_pending > 0);
+	pthread_mutex_unlock(&init_mutex);
+
+	if (starting) {
+		error(0, 0, "modules are still starting, not reloading");
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (count == 0) {
+		error(0, 0, "no modules to reload to");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (apply_modules(state, count, names) == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_kill(state->main_thread, SIGUSR1);
+	return 0;
+}
+
+/*
+ * Fills `names` with the running module list, in bar order, and returns its
+ * length. The names are good until the next reload.
+ */
+int my3status_module_list(char **names)
+{
+	int count = 0;
+
+	for (unsigned id = 0; id < instance_count; id += 1) {
+		if (instances[id].active) {
+			names[instances[id].slot] = instances[id].arg;
+			count += 1;
 		}
 	}
 
-	return r;
+	return count;
+}
+
+/*
+ * SIGHUP reloads the module list from MY3STATUS_MODULES_FILE, which holds
+ * module names separated by whitespace, like on the command line. Returns
+ * true if the modules changed.
+ */
+bool my3status_handle_sighup(struct my3status_state *state)
+{
+	if (!sighup_received) {
+		return false;
+	}
+
+	sighup_received = false;
+
+	const char *path = getenv("MY3STATUS_MODULES_FILE");
+	if (path == NULL) {
+		error(0, 0, "SIGHUP: MY3STATUS_MODULES_FILE not set, "
+		      "nothing to reload");
+		return false;
+	}
+
+	FILE *f = fopen(path, "re");
+	if (f == NULL) {
+		error(0, errno, "SIGHUP: can't read %s", path);
+		return false;
+	}
+
+	char *names[MY3STATUS_MAX_MODULES];
+	int count = 0;
+
+	while (count < MY3STATUS_MAX_MODULES &&
+	       fscanf(f, "%ms", &names[count]) == 1)
+	{
+		count += 1;
+	}
+
+	fclose(f);
+
+	int r = my3status_reload(state, count, names);
+
+	for (int i = 0; i < count; i += 1) {
+		free(names[i]);
+	}
+
+	return r == 0;
+}
+
+static int apply_modules(struct my3status_state *state, int count, char **names)
+{
+	// check everything before changing anything
+	for (int i = 0; i < count; i += 1) {
+		if (!check_module(names[i])) {
+			fprintf(stderr, "invalid module: %s\n", names[i]);
+			return -1;
+		}
+	}
+
+	int slots[MY3STATUS_MAX_MODULES];
+	for (unsigned i = 0; i < MY3STATUS_MAX_MODULES; i += 1) {
+		slots[i] = -1;
+	}
+
+	// instances the list names again keep running
+	unsigned new_count = 0;
+	for (int i = 0; i < count; i += 1) {
+		int id = find_instance(names[i], slots);
+		if (id == -1) {
+			new_count += 1;
+		} else {
+			slots[id] = i;
+		}
+	}
+
+	// dropped instances whose modules can stop make room for new ones;
+	// the rest stay around, off the bar
+	bool stop[MY3STATUS_MAX_MODULES] = { 0 };
+	unsigned room = MY3STATUS_MAX_MODULES - instance_count;
+	for (unsigned id = 0; id < instance_count; id += 1) {
+		if (instances[id].arg == NULL) {
+			room += 1;
+		} else if (slots[id] == -1) {
+			stop[id] = my3status_can_stop_instance(state, id);
+			room += stop[id];
+		}
+	}
+
+	if (new_count > room) {
+		error(0, 0, "too many modules, not reloading");
+		return -1;
+	}
+
+	for (unsigned id = 0; id < instance_count; id += 1) {
+		if (stop[id]) {
+			my3status_stop_instance(state, id);
+			free(instances[id].arg);
+			instances[id] = (struct instance) { 0 };
+		}
+	}
+
+	// the ones that didn't get a slot above are new
+	bool placed[MY3STATUS_MAX_MODULES] = { 0 };
+	for (unsigned id = 0; id < instance_count; id += 1) {
+		if (slots[id] >= 0) {
+			placed[slots[id]] = true;
+		}
+	}
+
+	bool is_new[MY3STATUS_MAX_MODULES] = { 0 };
+	for (int i = 0; i < count; i += 1) {
+		if (placed[i]) {
+			continue;
+		}
+
+		int id = free_instance();
+
+		struct instance *in = &instances[id];
+		in->arg = strdup(names[i]);
+		if (in->arg == NULL) {
+			error(1, errno, "strdup");
+		}
+
+		slots[id] = i;
+		is_new[id] = true;
+	}
+
+	for (unsigned id = 0; id < instance_count; id += 1) {
+		instances[id].active = (slots[id] >= 0);
+		instances[id].slot = slots[id];
+	}
+
+	my3status_arrange_modules(state, slots);
+
+	if (new_count == 0) {
+		return 0;
+	}
+
+	my3status_unfreeze_modules(state);
+
+	pthread_mutex_lock(&init_mutex);
+	inits_pending = new_count;
+	pthread_mutex_unlock(&init_mutex);
+
+	for (unsigned id = 0; id < instance_count; id += 1) {
+		if (!is_new[id]) {
+			continue;
+		}
+
+		const char *arg = instances[id].arg;
+		const struct builtin *b = find_builtin(arg);
+
+		register_placeholder(state, id, slots[id],
+				     b != NULL ? b->name : arg);
+		start_init(state, id, slots[id], arg, b);
+	}
+
+	return 0;
+}
+
+/*
+ * Catches what would otherwise only fail once the module is starting, and
+ * take the whole bar down with it.
+ */
+static bool check_module(const char *name)
+{
+	const struct builtin *b = find_builtin(name);
+	if (b != NULL && b->init != NULL) {
+		return true;
+	}
+
+	char *path = generate_module_path(b != NULL ? b->plugin : name);
+	if (path == NULL) {
+		return false;
+	}
+
+	bool ok = (access(path, R_OK) == 0);
+	if (!ok) {
+		error(0, errno, "%s", path);
+	}
+
+	free(path);
+	return ok;
+}
+
+/*
+ * Finds an instance started with `arg` that hasn't been given a slot yet.
+ */
+static int find_instance(const char *arg, const int *slots)
+{
+	for (unsigned id = 0; id < instance_count; id += 1) {
+		if (slots[id] == -1 && instances[id].arg != NULL &&
+		    strcmp(instances[id].arg, arg) == 0)
+		{
+			return id;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the lowest instance number not in use; the caller made sure there
+ * is one.
+ */
+static int free_instance()
+{
+	for (unsigned id = 0; id < instance_count; id += 1) {
+		if (instances[id].arg == NULL) {
+			return id;
+		}
+	}
+
+	return instance_count++;
+}
+
+static const struct builtin *find_builtin(const char *name)
+{
+	size_t n = sizeof(builtins) / sizeof(builtins[0]);
+
+	for (size_t i = 0; i < n; i += 1) {
+		if (strcmp(builtins[i].name, name) == 0) {
+			return &builtins[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Holds a slot with the module's output from the previous run, if there is
+ * one. External modules are cached under their file name minus ".so", which
+ * is usually what they register as.
+ */
+static void register_placeholder(
+	struct my3status_state	*state,
+	unsigned		 instance,
+	unsigned		 slot,
+	const char		*arg
+) {
+	char name[64];
+	module_name(arg, name, sizeof(name));
+
+	const char *cached = my3status_cache_lookup(name);
+	if (cached == NULL) {
+		return;
+	}
+
+	char *copy = strdup(name);
+	if (copy == NULL) {
+		error(1, errno, "strdup");
+	}
+
+	my3status_set_init_slot(instance, slot);
+	my3status_register_placeholder(state, copy, cached);
+}
+
+static void module_name(const char *arg, char *name, size_t size)
+{
+	snprintf(name, size, "%s", arg);
+
+	size_t len = strlen(name);
+	if (len > 3 && strcmp(name + len - 3, ".so") == 0) {
+		name[len - 3] = '\0';
+	}
+}
+
+static void start_init(
+	struct my3status_state	*state,
+	unsigned		 instance,
+	unsigned		 slot,
+	const char		*name,
+	const struct builtin	*builtin
+) {
+	struct pending_init *p = malloc(sizeof(struct pending_init));
+	if (p == NULL) {
+		error(1, errno, "malloc");
+	}
+
+	*p = (struct pending_init) {
+		.state = state, .instance = instance, .slot = slot,
+		.name = name, .builtin = builtin
+	};
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_t thread;
+	int r = pthread_create(&thread, &attr, run_init, p);
+	if (r != 0) {
+		error(1, r, "pthread_create");
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+static void *run_init(void *arg)
+{
+	struct pending_init *p = arg;
+	const struct builtin *b = p->builtin;
+	int r;
+
+	// modules registered from this thread go where they were asked for
+	my3status_set_init_slot(p->instance, p->slot);
+
+	// a module dropped by an earlier reload may still be on its way out
+	char name[64];
+	module_name(b != NULL ? b->name : p->name, name, sizeof(name));
+	my3status_wait_for_stopped(p->state, name);
+
+	if (b != NULL && b->init != NULL) {
+		r = b->init(p->state);
+	} else {
+		r = load_external_module(p->state, b != NULL ? b->plugin : p->name);
+	}
+
+	if (r == -1) {
+		error(1, 0, "invalid module: %s", p->name);
+	}
+
+	pthread_mutex_lock(&init_mutex);
+	bool last = (--inits_pending == 0);
+	pthread_cond_broadcast(&init_cond);
+	pthread_mutex_unlock(&init_mutex);
+
+	if (last) {
+		// whatever wasn't claimed by now belongs to a module that's gone
+		my3status_drop_placeholders(p->state);
+		my3status_freeze_modules(p->state);
+		pthread_kill(p->state->main_thread, SIGUSR1);
+	}
+
+	free(p);
+	return NULL;
+}
+
+static void wait_for_inits(unsigned timeout_ms)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+
+	deadline.tv_nsec += (long) timeout_ms * 1000000;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+
+	pthread_mutex_lock(&init_mutex);
+
+	while (inits_pending > 0) {
+		if (pthread_cond_timedwait(&init_cond, &init_mutex,
+					   &deadline) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&init_mutex);
 }
 
 static int load_external_module(struct my3status_state *s, const char *name)
@@ -178,17 +681,38 @@ static char *generate_module_path(const char *name)
 	return s;
 }
 
-static void wait_for_signals(int sfd)
+/*
+ * Waits up to `timeout_ms` (-1 for ever) for modules to signal an update.
+ * Returns false if none did. Deferred updates wake the caller as well, but
+ * only to reschedule; they don't count.
+ */
+bool my3status_wait_for_signals(int sfd, int timeout_ms)
 {
 	static struct signalfd_siginfo siginfo;
 
+	struct pollfd pfd = { .fd = sfd, .events = POLLIN };
+
+	int r = poll(&pfd, 1, timeout_ms);
+	if (r == -1 && errno != EINTR) {
+		error(1, errno, "poll");
+	}
+
+	if (r <= 0) {
+		return false;
+	}
+
 	ssize_t s = read(sfd, &siginfo, sizeof(siginfo));
 	if (s != sizeof(siginfo)) {
 		error(1, errno, "read");
 	}
 
+	sighup_received |= (siginfo.ssi_signo == SIGHUP);
+	bool update = (siginfo.ssi_signo != SIGUSR2);
+
 	// wait 30 ms for any other signals to arrive before we send off our output
-	usleep(30 * 1000);
+	if (update) {
+		usleep(30 * 1000);
+	}
 
 	// put the signalfd into non-blocking mode and try to read any other pending
 	// signals so we can treat multiple successive updates as one
@@ -197,6 +721,8 @@ static void wait_for_signals(int sfd)
 
 	while (s != -1) {
 		s = read(sfd, &siginfo, sizeof(siginfo));
+		sighup_received |= (s != -1 && siginfo.ssi_signo == SIGHUP);
+		update |= (s != -1 && siginfo.ssi_signo != SIGUSR2);
 	}
 
 	if (errno != EAGAIN) {
@@ -205,4 +731,6 @@ static void wait_for_signals(int sfd)
 
 	// revert signalfd to blocking mode for next iteration
 	fcntl(sfd, F_SETFL, flags);
+
+	return update;
 }
\ No newline at end of file
@@ -1,17 +1,91 @@
+#include <poll.h>
 #include <sys/timerfd.h>
 #include <time.h>
 #include "my3status.h"
 
-#define MAX_OUTPUT 32
+#define MAX_OUTPUT 160
+
+// the local zone plus up to four from MY3STATUS_CLOCK_ZONES
+#define MAX_ZONES 5
+#define LABEL_MAX 16
+
+// how far ahead to look for the next UTC offset change
+#define TRANSITION_HORIZON (366 * 86400)
 
 static char output[MAX_OUTPUT] = { 0xf0, 0x9f, 0x95, 0x9b, ' ', 0 };
 
+enum { FACE, DATE, TIME, ZONES };
+
+static const char *const faces[] = {
+	"🕐", "🕑", "🕒", "🕓", "🕔", "🕕", "🕖", "🕗", "🕘", "🕙", "🕚", "🕛"
+};
+
+static const struct my3status_format_field fields[] = {
+	[FACE] = {
+		.name = "face", .type = MY3STATUS_FORMAT_GLYPH,
+		.glyphs = faces, .glyph_count = 12
+	},
+	[DATE]	= { .name = "date", .type = MY3STATUS_FORMAT_STRING },
+	[TIME]	= { .name = "time", .type = MY3STATUS_FORMAT_STRING },
+	[ZONES]	= { .name = "zones", .type = MY3STATUS_FORMAT_STRING },
+};
+
+static struct my3status_format *format;
+
+struct zone {
+	struct my3status_tz *tz;	// NULL for the local zone
+	char		 label[LABEL_MAX];
+
+	long		 gmtoff;
+	time_t		 valid_until;	// when gmtoff next changes
+
+	struct tm	 tm;
+	char		*seconds;	// this zone's seconds digits in the output
+};
+
+static struct zone zones[MAX_ZONES];
+static int zone_count;
+static bool show_seconds;
+
+static time_t rendered_at = -1;
+
+static char date[32];
+static char local_time[16];
+// " LABEL HH:MM:SS" for every zone but the local one
+static char other_zones[(MAX_ZONES - 1) * (LABEL_MAX + 10)];
+
 static void *run(void *);
+static void parse_zones(const char *);
+static time_t now();
 static void start_timer(int);
 static void update_time(struct my3status_module *, time_t);
+static bool tick(time_t);
+static void render_all(time_t);
+static size_t render_zone_time(struct zone *, char *);
+static void zone_refresh(struct zone *, time_t);
+static long offset_at(time_t);
 
 int mod_clock_init(struct my3status_state *s)
 {
+	const char *seconds = getenv("MY3STATUS_CLOCK_SECONDS");
+	show_seconds = (seconds != NULL && strcmp(seconds, "0") != 0);
+
+	zone_count = 0;
+	rendered_at = -1;
+	zones[zone_count++] = (struct zone) { .tz = NULL };
+
+	const char *extra = getenv("MY3STATUS_CLOCK_ZONES");
+	if (extra != NULL) {
+		parse_zones(extra);
+	}
+
+	// a reload can start the module again
+	if (format == NULL) {
+		format = my3status_format_compile(
+			"clock", "{face} {date} {time}{zones}", fields, 4
+		);
+	}
+
 	return my3status_init_internal_module(
 		s, "clock", output, true, run
 	);
@@ -26,51 +100,126 @@ static void *run(void *arg)
 		error(1, errno, "mod_clock: timerfd_create");
 	}
 
-	time_t now = time(NULL);
-	update_time(m, now);
+	update_time(m, now());
 	start_timer(timer);
 
+	// every tick produces output, which doubles as a heartbeat
+	my3status_set_deadline(m, show_seconds ? 5 : 120);
+
+	struct pollfd pollfds[] = {
+		(struct pollfd) { .fd = timer, .events = POLLIN },
+		(struct pollfd) { .fd = m->stop_fd, .events = POLLIN },
+	};
+
 	unsigned long expirations;
 	ssize_t s;
 	while (1) {
-		s = read(timer, &expirations, sizeof(expirations));
-		now = time(NULL);
+		if (poll(pollfds, 2, -1) == -1 && errno != EINTR) {
+			error(1, errno, "mod_clock: poll");
+		}
 
-		update_time(m, now);
+		if (pollfds[1].revents & POLLIN) {
+			break;
+		}
 
-		if (s != -1) {
-			// normal expiration
+		if ((pollfds[0].revents & POLLIN) == 0) {
 			continue;
 		}
 
-		if (errno == ECANCELED) {
-			// system time was changed
+		s = read(timer, &expirations, sizeof(expirations));
+
+		if (s == -1 && errno == ECANCELED) {
+			// system time was changed; nothing cached holds up
+			for (int i = 0; i < zone_count; i += 1) {
+				zones[i].valid_until = 0;
+			}
+
+			rendered_at = -1;
 			start_timer(timer);
-		} else {
+		} else if (s == -1) {
 			error(1, errno, "mod_clock: read");
 		}
+
+		update_time(m, now());
+	}
+
+	close(timer);
+
+	for (int i = 0; i < zone_count; i += 1) {
+		my3status_tz_free(zones[i].tz);
 	}
 
-	// should not be reachable
 	return NULL;
 }
 
-static void start_timer(int tfd)
+/*
+ * Takes a comma separated list of zones, each either a tz database name or
+ * LABEL=NAME. Without a label, the part after the last slash is shown.
+ */
+static void parse_zones(const char *list)
 {
-	static struct itimerspec t = {
-		.it_interval = (struct timespec) { .tv_sec = 60, .tv_nsec = 0 },
-		.it_value = (struct timespec) { 0 }
-	};
+	char *copy = strdup(list);
+	if (copy == NULL) {
+		error(1, errno, "mod_clock: strdup");
+	}
 
-	static struct timespec now = { 0 };
+	char *saveptr;
+	for (char *tz = strtok_r(copy, ",", &saveptr);
+	     tz != NULL;
+	     tz = strtok_r(NULL, ",", &saveptr))
+	{
+		if (zone_count == MAX_ZONES) {
+			error(0, 0, "mod_clock: too many zones, ignoring %s", tz);
+			continue;
+		}
+
+		struct zone *z = &zones[zone_count];
+		const char *label;
+
+		char *eq = strchr(tz, '=');
+		if (eq != NULL) {
+			*eq = '\0';
+			label = tz;
+			tz = eq + 1;
+		} else {
+			const char *slash = strrchr(tz, '/');
+			label = (slash != NULL ? slash + 1 : tz);
+		}
+
+		z->tz = my3status_tz_load(tz);
+		if (z->tz == NULL) {
+			error(0, 0, "mod_clock: unknown zone, ignoring %s", tz);
+			continue;
+		}
 
-	if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
+		snprintf(z->label, LABEL_MAX, "%s", label);
+		zone_count += 1;
+	}
+}
+
+static time_t now()
+{
+	struct timespec ts;
+
+	// served from the vDSO, no syscall
+	if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
 		error(1, errno, "mod_clock: clock_gettime");
 	}
 
-	time_t seconds_left = 60 - now.tv_sec % 60;
-	t.it_value.tv_sec = now.tv_sec + seconds_left;
-	t.it_value.tv_nsec = 1000000000L - now.tv_nsec;
+	return ts.tv_sec;
+}
+
+static void start_timer(int tfd)
+{
+	time_t interval = show_seconds ? 1 : 60;
+
+	struct itimerspec t = {
+		.it_interval = (struct timespec) { .tv_sec = interval },
+	};
+
+	// fire exactly on the next second or minute boundary
+	time_t n = now();
+	t.it_value.tv_sec = n + interval - n % interval;
 
 	int flags = TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET;
 	if (timerfd_settime(tfd, flags, &t, NULL) == -1) {
@@ -78,24 +227,165 @@ static void start_timer(int tfd)
 	}
 }
 
-static void update_time(struct my3status_module *m, time_t now)
+static void update_time(struct my3status_module *m, time_t t)
 {
-	struct tm *tm = localtime(&now);
+	if (t == rendered_at) {
+		return;
+	}
 
-	if (tm == NULL) {
-		error(1, errno, "localtime");
+	if (t != rendered_at + 1 || !tick(t)) {
+		render_all(t);
 	}
 
+	rendered_at = t;
+
+	union my3status_format_value values[4];
+
+	const struct tm *tm = &zones[0].tm;
+	values[FACE].i = tm->tm_hour > 0 ? (tm->tm_hour - 1) % 12 : 11;
+	values[DATE].s = date;
+	values[TIME].s = local_time;
+	values[ZONES].s = other_zones;
+
 	my3status_output_begin(m);
+	my3status_format_render(format, values, output, MAX_OUTPUT);
+	my3status_output_done(m);
+}
+
+/*
+ * Advances every zone by one second by patching its seconds digits in place.
+ * Returns false if that isn't enough, i.e. a minute rolls over or an offset
+ * changes.
+ */
+static bool tick(time_t t)
+{
+	for (int i = 0; i < zone_count; i += 1) {
+		if (zones[i].tm.tm_sec == 59 || zones[i].valid_until <= t) {
+			return false;
+		}
+	}
 
-	output[3] =
-		tm->tm_hour > 0
-		? 0x90 + (tm->tm_hour - 1) % 12
-		: 0x9b;
+	for (int i = 0; i < zone_count; i += 1) {
+		struct zone *z = &zones[i];
+		z->tm.tm_sec += 1;
+
+		if (z->seconds != NULL) {
+			z->seconds[0] = '0' + z->tm.tm_sec / 10;
+			z->seconds[1] = '0' + z->tm.tm_sec % 10;
+		}
+	}
+
+	return true;
+}
+
+static void render_all(time_t t)
+{
+	for (int i = 0; i < zone_count; i += 1) {
+		struct zone *z = &zones[i];
 
-	if (strftime(output + 5, MAX_OUTPUT - 5, "%a %-d %b %R", tm) == 0) {
+		if (t >= z->valid_until) {
+			zone_refresh(z, t);
+		}
+
+		// plain arithmetic, so no zone lookups on the hot path
+		time_t local = t + z->gmtoff;
+		gmtime_r(&local, &z->tm);
+	}
+
+	if (strftime(date, sizeof(date), "%a %-d %b", &zones[0].tm) == 0) {
 		error(1, errno, "strftime");
 	}
 
-	my3status_output_done(m);
-}
\ No newline at end of file
+	local_time[render_zone_time(&zones[0], local_time)] = '\0';
+
+	char *p = other_zones;
+	char *end = other_zones + sizeof(other_zones);
+
+	for (int i = 1; i < zone_count; i += 1) {
+		int n = snprintf(p, end - p, " %s ", zones[i].label);
+
+		// sized for the longest labels, so this is only a backstop
+		if (n < 0 || n + 8 >= end - p) {
+			zones[i].seconds = NULL;
+			continue;
+		}
+
+		p += n;
+		p += render_zone_time(&zones[i], p);
+	}
+
+	*p = '\0';
+}
+
+static size_t render_zone_time(struct zone *z, char *out)
+{
+	const struct tm *tm = &z->tm;
+
+	out[0] = '0' + tm->tm_hour / 10;
+	out[1] = '0' + tm->tm_hour % 10;
+	out[2] = ':';
+	out[3] = '0' + tm->tm_min / 10;
+	out[4] = '0' + tm->tm_min % 10;
+
+	if (!show_seconds) {
+		z->seconds = NULL;
+		return 5;
+	}
+
+	out[5] = ':';
+	out[6] = '0' + tm->tm_sec / 10;
+	out[7] = '0' + tm->tm_sec % 10;
+
+	z->seconds = out + 6;
+	return 8;
+}
+
+/*
+ * Looks up the zone's current UTC offset and when it next changes. This is
+ * the only place that consults the tz database, so it runs about twice a year
+ * per zone. Other zones know their transitions; the libc only tells the local
+ * zone's offset at a given time, so that one is searched for.
+ */
+static void zone_refresh(struct zone *z, time_t t)
+{
+	z->valid_until = t + TRANSITION_HORIZON;
+
+	if (z->tz != NULL) {
+		z->gmtoff = my3status_tz_offset(z->tz, t, &z->valid_until);
+		return;
+	}
+
+	z->gmtoff = offset_at(t);
+
+	// step a day at a time until the offset differs, then narrow it down
+	for (time_t hi = t + 86400; hi <= t + TRANSITION_HORIZON; hi += 86400) {
+		if (offset_at(hi) == z->gmtoff) {
+			continue;
+		}
+
+		time_t lo = hi - 86400;
+		while (hi - lo > 1) {
+			time_t mid = lo + (hi - lo) / 2;
+
+			if (offset_at(mid) == z->gmtoff) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+
+		z->valid_until = hi;
+		break;
+	}
+}
+
+static long offset_at(time_t t)
+{
+	struct tm tm;
+
+	if (localtime_r(&t, &tm) == NULL) {
+		error(1, errno, "localtime_r");
+	}
+
+	return tm.tm_gmtoff;
+}
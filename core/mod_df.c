@@ -6,10 +6,21 @@
 
 static char output[MAX_OUTPUT] = "💾 ";
 
+static const struct my3status_format_field fields[] = {
+	{ .name = "used", .type = MY3STATUS_FORMAT_PERCENT },
+};
+
+static struct my3status_format *format;
+
 static void *run(void *);
 
 int mod_df_init(struct my3status_state *s)
 {
+	// a reload can start the module again
+	if (format == NULL) {
+		format = my3status_format_compile("df", "💾 {used}", fields, 1);
+	}
+
 	return my3status_init_internal_module(
 		s, "df", output, true, run
 	);
@@ -20,7 +31,10 @@ static void *run(void *arg)
 	struct my3status_module *m = arg;
 
 	struct statfs s;
-	int previous_used_percent = -1;
+	union my3status_format_value values[1];
+
+	// a hung filesystem shouldn't go unnoticed
+	my3status_set_deadline(m, 60);
 
 	while (1) {
 		if (statfs("/", &s) != 0) {
@@ -30,22 +44,22 @@ static void *run(void *arg)
 		unsigned long total = s.f_blocks;
 		unsigned long used  = total - s.f_bavail;
 
-		int used_percent = round((100.0f / total) * used);
+		values[0].i = round((100.0f / total) * used);
 
-		if (used_percent == previous_used_percent) {
+		if (!my3status_format_changed(format, values)) {
 			goto sleep;
 		}
 
 		my3status_output_begin(m);
-		snprintf(output + 5, MAX_OUTPUT - 5, "%d%%", used_percent);
+		my3status_format_render(format, values, output, MAX_OUTPUT);
 		my3status_output_done(m);
 
-		previous_used_percent = used_percent;
-
 	sleep:
-		sleep(10);
+		my3status_heartbeat(m);
+		if (!my3status_sleep(m, 10)) {
+			break;
+		}
 	}
 
-	// should not be reachable
 	return NULL;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <sys/inotify.h>
 #include <sys/stat.h>
 #include "my3status.h"
@@ -45,7 +46,24 @@ static void *run(void *arg)
 
 	print_items(m);
 
+	struct pollfd pollfds[] = {
+		(struct pollfd) { .fd = inotify_fd, .events = POLLIN },
+		(struct pollfd) { .fd = m->stop_fd, .events = POLLIN },
+	};
+
 	while (1) {
+		if (poll(pollfds, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			PANIC(errno, "poll");
+		}
+
+		if (pollfds[1].revents & POLLIN) {
+			break;
+		}
+
 		if (read(inotify_fd, event, event_size) == -1) {
 			PANIC(errno, "couldn't read from inotify fd");
 		}
@@ -53,6 +71,11 @@ static void *run(void *arg)
 		print_items(m);
 	}
 
+	close(inotify_fd);
+	close(items_dir_fd);
+	free(items_dir);
+	free(event);
+
 	return NULL;
 }
 
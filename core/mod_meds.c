@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <sys/inotify.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 
@@ -9,87 +10,247 @@
 #include "my3status.h"
 
 #define MAX_OUTPUT 32
-#define STUPID_HARDCODED_DB_PATH "/home/tobias/Nextcloud/meds.sqlite"
+#define STUPID_HARDCODED_DB_DIR "/home/tobias/Nextcloud"
+#define STUPID_HARDCODED_DB_NAME "meds.sqlite"
+#define STUPID_HARDCODED_DB_PATH STUPID_HARDCODED_DB_DIR "/" STUPID_HARDCODED_DB_NAME
 
-#define INOTIFY_BUF_SIZE (sizeof(struct inotify_event) + NAME_MAX + 1)
+#define INOTIFY_BUF_SIZE (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+// how long to sleep when there's nothing to count up
+#define IDLE_SLEEP 3600
 
 static char output[MAX_OUTPUT] = "💊 ";
 
+enum { WHICH, ELAPSED };
+
+static const struct my3status_format_field fields[] = {
+	[WHICH]		= { .name = "which", .type = MY3STATUS_FORMAT_STRING },
+	[ELAPSED]	= { .name = "elapsed", .type = MY3STATUS_FORMAT_DURATION },
+};
+
+static struct my3status_format *format;
+
 const char *SQL_LATEST_RECORD =
 	"SELECT \"when\", \"which\" FROM \"pills_taken\" "
 	"WHERE strftime('%s', 'now') - \"when\" < 86400 "
 	"ORDER BY \"when\" DESC "
 	"LIMIT 1";
 
-static void *run(void *);
-static time_t update_output(struct my3status_module *, sqlite3 *,
-			    sqlite3_stmt *);
+const char *SQL_DATA_VERSION = "PRAGMA data_version";
+
+struct db {
+	sqlite3		*conn;
+	sqlite3_stmt	*latest_record_stmt;
+	sqlite3_stmt	*data_version_stmt;
+	sqlite3_int64	 data_version;
+	ino_t		 inode;
+};
 
-static void db_connect(sqlite3 **, sqlite3_stmt **);
+struct record {
+	bool		 found;
+	sqlite3_int64	 when;
+	char		 which[MAX_OUTPUT];
+};
+
+static void *run(void *);
+static time_t update_output(struct my3status_module *, const struct record *);
+
+static void db_connect(struct db *);
+static void db_close(struct db *);
+static bool db_replaced(struct db *);
+static bool db_data_changed(struct db *);
+static void db_query_latest_record(struct db *, struct record *);
+static sqlite3_int64 db_step_int64(struct db *, sqlite3_stmt *);
 static int db_init_watch();
+static bool db_watch_triggered(int);
 
-int mod_meds_init(struct my3status_state *s)
+void my3status_module_init(struct my3status_state *s)
 {
-	return my3status_init_internal_module(
+	// a reload can start the module again
+	if (format == NULL) {
+		format = my3status_format_compile(
+			"meds", "💊 {which} {elapsed}", fields, 2
+		);
+	}
+
+	int r = my3status_init_internal_module(
 		s, "meds", output, true, run
 	);
+
+	if (r == -1) {
+		error(1, errno, "meds: can't start module thread");
+	}
 }
 
 static void *run(void *arg)
 {
 	struct my3status_module *m = arg;
 
-	sqlite3 *db = NULL;
-	sqlite3_stmt *latest_record_stmt = NULL;
+	struct db db = { 0 };
+	struct record record = { 0 };
 
-	db_connect(&db, &latest_record_stmt);
+	// watch before connecting, so we can't miss a write in between
 	int ino_fd = db_init_watch();
 
+	db_connect(&db);
+	db_query_latest_record(&db, &record);
+
 	struct pollfd pollfds[] = {
-		(struct pollfd) { .fd = ino_fd, .events = POLLIN }
+		(struct pollfd) { .fd = ino_fd, .events = POLLIN },
+		(struct pollfd) { .fd = m->stop_fd, .events = POLLIN },
 	};
 
-	ssize_t s;
-	char buf[INOTIFY_BUF_SIZE];
+	my3status_set_deadline(m, IDLE_SLEEP * 2);
+
 	while (1) {
-		time_t sleep_for = update_output(m, db, latest_record_stmt);
+		time_t sleep_for = update_output(m, &record);
+		my3status_heartbeat(m);
 
-		int r = poll(pollfds, 1, sleep_for * 1000);
+		int r = poll(pollfds, 2, sleep_for * 1000);
 
 		if (r == -1) {
 			error(1, errno, "poll()");
 		}
 
-		if (r == 0) {
+		if (r > 0 && (pollfds[1].revents & POLLIN)) {
+			break;
+		}
+
+		if (r == 0 || !db_watch_triggered(ino_fd)) {
 			continue;
 		}
 
-		s = read(ino_fd, buf, INOTIFY_BUF_SIZE);
-		if (s == -1) {
-			error(1, errno, "%s: read: ", __func__);
+		// Sync clients replace the file rather than writing to it, so
+		// a new inode means our connection is looking at a dead file.
+		if (db_replaced(&db)) {
+			db_close(&db);
+			db_connect(&db);
+		} else if (!db_data_changed(&db)) {
+			continue;
 		}
+
+		db_query_latest_record(&db, &record);
 	}
 
-	// should be unreachable
+	db_close(&db);
+	close(ino_fd);
+
 	return NULL;
 }
 
 static time_t update_output(
 	struct my3status_module	*m,
-	sqlite3			*db,
-	sqlite3_stmt		*latest_record_stmt
+	const struct record	*record
 ) {
-	static uint64_t previous_minutes = -1;
-	static uint64_t previous_hours = -1;
-	static uint64_t previous_days = -1;
+	uint64_t now = (uint64_t) time(NULL);
+	uint64_t seconds = now - record->when;
+
+	if (!record->found || seconds >= 86400) {
+		if (m->output_visible) {
+			my3status_output_begin(m);
+			m->output_visible = 0;
+			my3status_output_done(m);
+		}
+
+		return IDLE_SLEEP;
+	}
+
+	union my3status_format_value values[2];
+
+	// only whole minutes show up in the output
+	values[WHICH].s = record->which;
+	values[ELAPSED].i = seconds - seconds % 60;
+
+	if (m->output_visible && !my3status_format_changed(format, values)) {
+		goto no_output_update;
+	}
+
+	my3status_output_begin(m);
+	m->output_visible = 1;
+	my3status_format_render(format, values, output, MAX_OUTPUT);
+	my3status_output_done(m);
+
+no_output_update:
+	return 60 - (seconds % 60);
+}
+
+static void db_connect(struct db *db)
+{
+	int r;
+
+	struct stat st;
+	if (stat(STUPID_HARDCODED_DB_PATH, &st) == -1) {
+		error(1, errno, "can't stat meds.sqlite");
+	}
+
+	db->inode = st.st_ino;
+
+	r = sqlite3_open_v2(STUPID_HARDCODED_DB_PATH, &db->conn, SQLITE_OPEN_READONLY, NULL);
+	if (r != SQLITE_OK) {
+		error(1, 0, "can't open meds.sqlite: %s", sqlite3_errmsg(db->conn));
+	}
+
+	r = sqlite3_prepare(db->conn, SQL_LATEST_RECORD, -1, &db->latest_record_stmt, NULL);
+	if (r != SQLITE_OK) {
+		error(1, 0, "can't prepare statement: %s", sqlite3_errmsg(db->conn));
+	}
+
+	r = sqlite3_prepare(db->conn, SQL_DATA_VERSION, -1, &db->data_version_stmt, NULL);
+	if (r != SQLITE_OK) {
+		error(1, 0, "can't prepare statement: %s", sqlite3_errmsg(db->conn));
+	}
+
+	db->data_version = db_step_int64(db, db->data_version_stmt);
+}
+
+static void db_close(struct db *db)
+{
+	sqlite3_finalize(db->latest_record_stmt);
+	sqlite3_finalize(db->data_version_stmt);
+	sqlite3_close(db->conn);
+
+	*db = (struct db) { 0 };
+}
+
+static bool db_replaced(struct db *db)
+{
+	struct stat st;
+
+	// mid-rename, the name might briefly point nowhere; keep the old
+	// connection and wait for the next event
+	if (stat(STUPID_HARDCODED_DB_PATH, &st) == -1) {
+		return false;
+	}
+
+	return st.st_ino != db->inode;
+}
 
+/*
+ * PRAGMA data_version changes whenever another connection commits to the
+ * database, so unrelated writes in the directory cost us this and nothing
+ * else.
+ */
+static bool db_data_changed(struct db *db)
+{
+	sqlite3_int64 v = db_step_int64(db, db->data_version_stmt);
+
+	if (v == db->data_version) {
+		return false;
+	}
+
+	db->data_version = v;
+	return true;
+}
+
+static void db_query_latest_record(struct db *db, struct record *record)
+{
 	int r;
 
 retry:
-	r = sqlite3_step(latest_record_stmt);
+	r = sqlite3_step(db->latest_record_stmt);
 	switch (r) {
 	case SQLITE_ROW:
-		m->output_visible = 1;
+		record->found = true;
 		break;
 
 	case SQLITE_BUSY:
@@ -98,77 +259,61 @@ retry:
 		goto retry;
 
 	case SQLITE_DONE:
-		m->output_visible = 0;
-		goto no_output_update;
+		record->found = false;
+		goto reset;
 
 	default:
-		error(1, 0, "can't execute statement: %d, %s", r, sqlite3_errmsg(db));
+		error(1, 0, "can't execute statement: %d, %s", r, sqlite3_errmsg(db->conn));
 	}
 
-	sqlite_int64 time_value = sqlite3_column_int64(latest_record_stmt, 0);
+	record->when = sqlite3_column_int64(db->latest_record_stmt, 0);
 
-	const unsigned char *which = sqlite3_column_text(latest_record_stmt, 1);
+	const unsigned char *which = sqlite3_column_text(db->latest_record_stmt, 1);
 	if (which == NULL) {
 		which = (unsigned char *) "NULL";
 	}
 
-	uint64_t now = (uint64_t) time(NULL);
-
-	uint64_t seconds	= now - time_value;
-	uint64_t minutes	= (seconds % 3600) / 60;
-	uint64_t hours		= (seconds % 86400) / 3600;
-	uint64_t days		= seconds / 86400;
-
-	if (previous_minutes == minutes &&
-	    previous_hours == hours &&
-	    previous_days == days)
-	{
-		goto no_output_update;
-	}
-
-	my3status_output_begin(m);
+	snprintf(record->which, MAX_OUTPUT, "%s", which);
 
-	if (days > 0) {
-		snprintf(output + 5, MAX_OUTPUT - 5, "%s %ldd", which, days);
-	} else {
-		snprintf(output + 5, MAX_OUTPUT - 5, "%s %01ld:%02ld", which, hours, minutes);
-	}
-
-	my3status_output_done(m);
-
-	r = sqlite3_reset(latest_record_stmt);
+reset:
+	r = sqlite3_reset(db->latest_record_stmt);
 	if (r != SQLITE_OK) {
-		error(1, 0, "can't reset statement: %s", sqlite3_errmsg(db));
+		error(1, 0, "can't reset statement: %s", sqlite3_errmsg(db->conn));
 	}
-
-no_output_update:
-	previous_minutes = minutes;
-	previous_hours = hours;
-	previous_days = days;
-
-	uint32_t sleep_for =
-		days > 0
-		? 86400 - (seconds % 86400)
-		: 60 - (seconds % 60);
-
-	return sleep_for;
 }
 
-static void db_connect(sqlite3 **db, sqlite3_stmt **latest_record_stmt)
+static sqlite3_int64 db_step_int64(struct db *db, sqlite3_stmt *stmt)
 {
 	int r;
 
-	r = sqlite3_open_v2(STUPID_HARDCODED_DB_PATH, db, SQLITE_OPEN_READONLY, NULL);
-	if (r != SQLITE_OK) {
-		error(1, 0, "can't open meds.sqlite: %s", sqlite3_errmsg(*db));
+retry:
+	r = sqlite3_step(stmt);
+	switch (r) {
+	case SQLITE_ROW:
+		break;
+
+	case SQLITE_BUSY:
+		usleep(10 * 1000);
+		goto retry;
+
+	default:
+		error(1, 0, "can't execute statement: %d, %s", r, sqlite3_errmsg(db->conn));
 	}
 
-	r = sqlite3_prepare(*db, SQL_LATEST_RECORD, -1, latest_record_stmt, NULL);
+	sqlite3_int64 v = sqlite3_column_int64(stmt, 0);
+
+	r = sqlite3_reset(stmt);
 	if (r != SQLITE_OK) {
-		error(1, 0, "can't prepare statement: %s", sqlite3_errmsg(*db));
+		error(1, 0, "can't reset statement: %s", sqlite3_errmsg(db->conn));
 	}
+
+	return v;
 }
 
+/*
+ * Watches the directory rather than the file itself, because a watch on the
+ * file dies silently when a sync client renames a new copy over it.
+ */
 static int db_init_watch()
 {
 	int fd = inotify_init();
@@ -179,8 +324,8 @@ static int db_init_watch()
 	int flags = fcntl(fd, F_GETFL, 0);
 	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 
-	uint32_t watch_mask = IN_MODIFY;
-	int r = inotify_add_watch(fd, STUPID_HARDCODED_DB_PATH, watch_mask);
+	uint32_t watch_mask = IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+	int r = inotify_add_watch(fd, STUPID_HARDCODED_DB_DIR, watch_mask);
 
 	if (r == -1) {
 		error(1, errno, "%s: inotify_add_watch: ", __func__);
@@ -188,3 +333,40 @@ static int db_init_watch()
 
 	return fd;
 }
+
+/*
+ * Drains pending events and tells whether any of them were about the
+ * database or its write-ahead log.
+ */
+static bool db_watch_triggered(int fd)
+{
+	static char buf[INOTIFY_BUF_SIZE]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+
+	bool triggered = false;
+	ssize_t s;
+
+	while ((s = read(fd, buf, INOTIFY_BUF_SIZE)) > 0) {
+		const struct inotify_event *e;
+
+		for (char *p = buf; p < buf + s; p += sizeof(*e) + e->len) {
+			e = (const struct inotify_event *) p;
+
+			if (e->len == 0) {
+				continue;
+			}
+
+			if (strcmp(e->name, STUPID_HARDCODED_DB_NAME) == 0 ||
+			    strcmp(e->name, STUPID_HARDCODED_DB_NAME "-wal") == 0)
+			{
+				triggered = true;
+			}
+		}
+	}
+
+	if (s == -1 && errno != EAGAIN) {
+		error(1, errno, "%s: read: ", __func__);
+	}
+
+	return triggered;
+}
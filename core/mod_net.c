@@ -0,0 +1,498 @@
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include "my3status.h"
+
+#define MAX_OUTPUT 256
+#define MAX_LINKS 32
+
+// seconds between counter dumps, unless MY3STATUS_NET_INTERVAL says otherwise
+#define DEFAULT_INTERVAL 2
+
+#define NL_BUF_SIZE 32768
+
+static char output[MAX_OUTPUT] = "🌐 ";
+
+enum { LINKS };
+
+static const struct my3status_format_field fields[] = {
+	[LINKS] = { .name = "links", .type = MY3STATUS_FORMAT_STRING },
+};
+
+static struct my3status_format *format;
+
+struct link {
+	int		 index;
+	char		 name[IF_NAMESIZE];
+	unsigned	 flags;
+	bool		 has_addr;
+
+	// counters as of the last dump, and the rates derived from them
+	bool		 sampled;
+	uint64_t	 rx_bytes;
+	uint64_t	 tx_bytes;
+	uint64_t	 rx_rate;
+	uint64_t	 tx_rate;
+};
+
+static struct link links[MAX_LINKS];
+static int link_count;
+
+static time_t interval = DEFAULT_INTERVAL;
+static struct timespec last_sample;
+
+static char links_text[MAX_OUTPUT];
+
+static void *run(void *);
+static int nl_open(unsigned);
+static void nl_dump(int, int, size_t, void (*)(struct nlmsghdr *, double),
+		    double);
+static void nl_read_events(int, bool *, bool *);
+static void on_link(struct nlmsghdr *, double);
+static void on_addr(struct nlmsghdr *, double);
+static struct link *find_link(int, bool);
+static void remove_link(int);
+static double seconds_since_last_sample();
+static bool any_link_up();
+static void set_timer(int, bool);
+static void print_links(struct my3status_module *);
+static void print_rate(char **, char *, const char *, uint64_t);
+
+int mod_net_init(struct my3status_state *s)
+{
+	const char *env = getenv("MY3STATUS_NET_INTERVAL");
+	if (env != NULL && atoi(env) > 0) {
+		interval = atoi(env);
+	}
+
+	link_count = 0;
+
+	// a reload can start the module again
+	if (format == NULL) {
+		format = my3status_format_compile(
+			"net", "🌐 {links}", fields, 1
+		);
+	}
+
+	return my3status_init_internal_module(
+		s, "net", output, true, run
+	);
+}
+
+static void *run(void *arg)
+{
+	struct my3status_module *m = arg;
+
+	int events = nl_open(
+		RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR
+	);
+	int dumps = nl_open(0);
+
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (timer == -1) {
+		PANIC(errno, "timerfd_create");
+	}
+
+	nl_dump(dumps, RTM_GETLINK, sizeof(struct ifinfomsg), on_link, 0);
+	nl_dump(dumps, RTM_GETADDR, sizeof(struct ifaddrmsg), on_addr, 0);
+
+	bool timer_armed = any_link_up();
+	set_timer(timer, timer_armed);
+	print_links(m);
+
+	struct pollfd pollfds[] = {
+		(struct pollfd) { .fd = events, .events = POLLIN },
+		(struct pollfd) { .fd = timer, .events = POLLIN },
+		(struct pollfd) { .fd = m->stop_fd, .events = POLLIN },
+	};
+
+	while (1) {
+		if (poll(pollfds, 3, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			PANIC(errno, "poll");
+		}
+
+		if (pollfds[2].revents & POLLIN) {
+			break;
+		}
+
+		if (pollfds[0].revents & POLLIN) {
+			bool addrs_changed = false;
+			bool resync = false;
+			nl_read_events(events, &addrs_changed, &resync);
+
+			// with events lost, only a dump tells which links are
+			// left and in what state
+			if (resync) {
+				link_count = 0;
+				nl_dump(dumps, RTM_GETLINK,
+					sizeof(struct ifinfomsg), on_link, -1);
+			}
+
+			// address events don't say which addresses are left, so
+			// ask again rather than keeping count
+			if (addrs_changed || resync) {
+				for (int i = 0; i < link_count; i += 1) {
+					links[i].has_addr = false;
+				}
+
+				nl_dump(dumps, RTM_GETADDR,
+					sizeof(struct ifaddrmsg), on_addr, 0);
+			}
+		}
+
+		if (pollfds[1].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(timer, &expirations, sizeof(expirations)) == -1) {
+				PANIC(errno, "read timerfd");
+			}
+
+			// one dump returns the counters of every link at once
+			nl_dump(dumps, RTM_GETLINK, sizeof(struct ifinfomsg),
+				on_link, seconds_since_last_sample());
+		}
+
+		// nothing to measure while every link is down, so don't wake up
+		bool up = any_link_up();
+		if (up != timer_armed) {
+			set_timer(timer, up);
+			timer_armed = up;
+		}
+
+		print_links(m);
+	}
+
+	close(events);
+	close(dumps);
+	close(timer);
+
+	return NULL;
+}
+
+static int nl_open(unsigned groups)
+{
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd == -1) {
+		PANIC(errno, "socket");
+	}
+
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = groups
+	};
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		PANIC(errno, "bind");
+	}
+
+	return fd;
+}
+
+/*
+ * Sends a dump request for `type` and feeds every reply to `handler`.
+ */
+static void nl_dump(
+	int	  fd,
+	int	  type,
+	size_t	  payload_size,
+	void	(*handler)(struct nlmsghdr *, double),
+	double	  elapsed
+) {
+	static uint32_t seq;
+	static char buf[NL_BUF_SIZE]
+		__attribute__((aligned(__alignof__(struct nlmsghdr))));
+
+	struct {
+		struct nlmsghdr	nh;
+		char		payload[sizeof(struct ifinfomsg)];
+	} req = {
+		.nh = {
+			.nlmsg_len = NLMSG_LENGTH(payload_size),
+			.nlmsg_type = type,
+			.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+			.nlmsg_seq = ++seq
+		}
+	};
+
+	// ifi_family and ifa_family both come first and stay AF_UNSPEC
+	if (send(fd, &req, req.nh.nlmsg_len, 0) == -1) {
+		PANIC(errno, "send");
+	}
+
+	while (1) {
+		ssize_t n = recv(fd, buf, NL_BUF_SIZE, 0);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			PANIC(errno, "recv");
+		}
+
+		for (struct nlmsghdr *nh = (struct nlmsghdr *) buf;
+		     NLMSG_OK(nh, n);
+		     nh = NLMSG_NEXT(nh, n))
+		{
+			if (nh->nlmsg_seq != seq) {
+				continue;
+			}
+
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				return;
+			}
+
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(nh);
+				PANIC(-e->error, "netlink dump failed");
+			}
+
+			handler(nh, elapsed);
+		}
+	}
+}
+
+static void nl_read_events(int fd, bool *addrs_changed, bool *resync)
+{
+	static char buf[NL_BUF_SIZE]
+		__attribute__((aligned(__alignof__(struct nlmsghdr))));
+
+	ssize_t n;
+	while ((n = recv(fd, buf, NL_BUF_SIZE, MSG_DONTWAIT)) > 0) {
+		for (struct nlmsghdr *nh = (struct nlmsghdr *) buf;
+		     NLMSG_OK(nh, n);
+		     nh = NLMSG_NEXT(nh, n))
+		{
+			switch (nh->nlmsg_type) {
+			case RTM_NEWLINK:
+				on_link(nh, -1);
+				break;
+
+			case RTM_DELLINK:
+				remove_link(((struct ifinfomsg *)
+					     NLMSG_DATA(nh))->ifi_index);
+				break;
+
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+				*addrs_changed = true;
+				break;
+			}
+		}
+	}
+
+	// the kernel drops events when we fall behind; full dumps catch up
+	if (n == -1 && errno == ENOBUFS) {
+		*resync = true;
+	} else if (n == -1 && errno != EAGAIN) {
+		PANIC(errno, "recv");
+	}
+}
+
+/*
+ * Handles RTM_NEWLINK, both from dumps and events. Counters are only taken
+ * from dumps, which pass how long it has been since the previous one; events
+ * pass a negative value.
+ */
+static void on_link(struct nlmsghdr *nh, double elapsed)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct link *l = find_link(ifi->ifi_index, true);
+
+	if (l == NULL) {
+		return;
+	}
+
+	l->flags = ifi->ifi_flags;
+
+	int len = IFLA_PAYLOAD(nh);
+	for (struct rtattr *rta = IFLA_RTA(ifi);
+	     RTA_OK(rta, len);
+	     rta = RTA_NEXT(rta, len))
+	{
+		if (rta->rta_type == IFLA_IFNAME) {
+			snprintf(l->name, IF_NAMESIZE, "%s",
+				 (char *) RTA_DATA(rta));
+		}
+
+		if (rta->rta_type != IFLA_STATS64 || elapsed < 0) {
+			continue;
+		}
+
+		// older kernels send a shorter struct
+		struct rtnl_link_stats64 stats = { 0 };
+		memcpy(&stats, RTA_DATA(rta),
+		       MIN(RTA_PAYLOAD(rta), sizeof(stats)));
+
+		if (l->sampled && elapsed > 0 &&
+		    stats.rx_bytes >= l->rx_bytes &&
+		    stats.tx_bytes >= l->tx_bytes)
+		{
+			l->rx_rate = (stats.rx_bytes - l->rx_bytes) / elapsed;
+			l->tx_rate = (stats.tx_bytes - l->tx_bytes) / elapsed;
+		}
+
+		l->rx_bytes = stats.rx_bytes;
+		l->tx_bytes = stats.tx_bytes;
+		l->sampled = true;
+	}
+}
+
+static void on_addr(struct nlmsghdr *nh, __attribute__((unused)) double _)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+
+	// link-local addresses don't count as being connected
+	if (ifa->ifa_scope != RT_SCOPE_UNIVERSE) {
+		return;
+	}
+
+	struct link *l = find_link(ifa->ifa_index, false);
+	if (l != NULL) {
+		l->has_addr = true;
+	}
+}
+
+static struct link *find_link(int index, bool create)
+{
+	for (int i = 0; i < link_count; i += 1) {
+		if (links[i].index == index) {
+			return &links[i];
+		}
+	}
+
+	if (!create || link_count == MAX_LINKS) {
+		return NULL;
+	}
+
+	links[link_count] = (struct link) { .index = index };
+	return &links[link_count++];
+}
+
+static void remove_link(int index)
+{
+	for (int i = 0; i < link_count; i += 1) {
+		if (links[i].index == index) {
+			links[i] = links[--link_count];
+			return;
+		}
+	}
+}
+
+static double seconds_since_last_sample()
+{
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+		PANIC(errno, "clock_gettime");
+	}
+
+	double elapsed =
+		(now.tv_sec - last_sample.tv_sec) +
+		(now.tv_nsec - last_sample.tv_nsec) / 1e9;
+
+	last_sample = now;
+	return elapsed;
+}
+
+static bool link_shown(const struct link *l)
+{
+	unsigned up = IFF_UP | IFF_RUNNING;
+
+	return (l->flags & up) == up &&
+	       (l->flags & IFF_LOOPBACK) == 0 &&
+	       l->has_addr;
+}
+
+static bool any_link_up()
+{
+	for (int i = 0; i < link_count; i += 1) {
+		if (link_shown(&links[i])) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void set_timer(int tfd, bool armed)
+{
+	struct itimerspec t = { 0 };
+
+	if (armed) {
+		t.it_interval.tv_sec = interval;
+		t.it_value.tv_sec = interval;
+
+		// counters are stale after a pause; the first dump is a baseline
+		seconds_since_last_sample();
+		for (int i = 0; i < link_count; i += 1) {
+			links[i].sampled = false;
+			links[i].rx_rate = links[i].tx_rate = 0;
+		}
+	}
+
+	if (timerfd_settime(tfd, 0, &t, NULL) == -1) {
+		PANIC(errno, "timerfd_settime");
+	}
+}
+
+static void print_links(struct my3status_module *m)
+{
+	char *p = links_text;
+	char *end = links_text + sizeof(links_text);
+
+	for (int i = 0; i < link_count && p < end; i += 1) {
+		const struct link *l = &links[i];
+
+		if (!link_shown(l)) {
+			continue;
+		}
+
+		p += snprintf(p, end - p, "%s%s", p == links_text ? "" : " ",
+			      l->name);
+		print_rate(&p, end, " ↓", l->rx_rate);
+		print_rate(&p, end, " ↑", l->tx_rate);
+	}
+
+	if (p == links_text) {
+		snprintf(links_text, sizeof(links_text), "down");
+	}
+
+	union my3status_format_value values[1] = {
+		[LINKS] = { .s = links_text }
+	};
+
+	if (!my3status_format_changed(format, values)) {
+		return;
+	}
+
+	my3status_output_begin(m);
+	my3status_format_render(format, values, output, MAX_OUTPUT);
+	my3status_output_done(m);
+}
+
+static void print_rate(char **p, char *end, const char *arrow, uint64_t rate)
+{
+	static const char units[] = "BKMGT";
+
+	double v = rate;
+	int unit = 0;
+
+	while (v >= 1000 && unit < 4) {
+		v /= 1000;
+		unit += 1;
+	}
+
+	if (*p >= end) {
+		return;
+	}
+
+	*p += snprintf(*p, end - *p, unit > 0 && v < 10 ? "%s%.1f%c" : "%s%.0f%c",
+		       arrow, v, units[unit]);
+}
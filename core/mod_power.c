@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "my3status.h"
+
+#define MAX_OUTPUT 32
+#define MAX_SUPPLIES 8
+
+#define SUPPLY_DIR "/class/power_supply"
+
+// not every battery sends uevents as it drains, so look anyway now and then,
+// every this many seconds unless MY3STATUS_POWER_INTERVAL says otherwise
+#define DEFAULT_INTERVAL 120
+
+#define UEVENT_BUF_SIZE 4096
+
+static char output[MAX_OUTPUT] = "🔋 ";
+
+enum { SOURCE, CAPACITY };
+
+static const char *const sources[] = { "🔋", "🔌" };
+
+static const struct my3status_format_field fields[] = {
+	[SOURCE] = {
+		.name = "source", .type = MY3STATUS_FORMAT_GLYPH,
+		.glyphs = sources, .glyph_count = 2
+	},
+	[CAPACITY] = { .name = "capacity", .type = MY3STATUS_FORMAT_PERCENT },
+};
+
+static struct my3status_format *format;
+
+/*
+ * Attribute fds stay open for the life of a supply; sysfs hands out a fresh
+ * value on every pread() at offset 0.
+ */
+struct supply {
+	bool	is_battery;
+	int	online_fd;	// mains
+	int	capacity_fd;	// battery
+	int	status_fd;	// battery
+};
+
+static struct supply supplies[MAX_SUPPLIES];
+static int supply_count;
+
+static char *supply_dir;
+
+static time_t interval = DEFAULT_INTERVAL;
+
+static void *run(void *);
+static int uevent_open();
+static bool uevent_read(int, bool *);
+static void scan_supplies();
+static void close_supplies();
+static int open_attr(int, const char *);
+static bool read_attr(int, char *, size_t);
+static long read_long(int);
+static void print_state(struct my3status_module *);
+
+int mod_power_init(struct my3status_state *s)
+{
+	const char *env = getenv("MY3STATUS_POWER_INTERVAL");
+	if (env != NULL && atoi(env) > 0) {
+		interval = atoi(env);
+	}
+
+	// point this at a fake tree to test without a laptop
+	const char *root = getenv("MY3STATUS_SYSFS_ROOT");
+	if (root == NULL) {
+		root = "/sys";
+	}
+
+	if (asprintf(&supply_dir, "%s" SUPPLY_DIR, root) == -1) {
+		error(1, errno, "asprintf");
+	}
+
+	// a reload can start the module again
+	if (format == NULL) {
+		format = my3status_format_compile(
+			"power", "{source} {capacity}", fields, 2
+		);
+	}
+
+	return my3status_init_internal_module(
+		s, "power", output, false, run
+	);
+}
+
+static void *run(void *arg)
+{
+	struct my3status_module *m = arg;
+
+	// subscribe before scanning, so nothing slips through in between
+	int fd = uevent_open();
+	scan_supplies();
+	print_state(m);
+
+	struct pollfd pollfds[] = {
+		(struct pollfd) { .fd = fd, .events = POLLIN },
+		(struct pollfd) { .fd = m->stop_fd, .events = POLLIN },
+	};
+
+	my3status_set_deadline(m, interval * 2);
+
+	// unrelated uevents wake us up too, so the fallback keeps its own time
+	int64_t fallback_at = my3status_now_ms() + interval * 1000;
+
+	while (1) {
+		int64_t timeout = fallback_at - my3status_now_ms();
+
+		int r = poll(pollfds, 2, timeout > 0 ? timeout : 0);
+		if (r == -1 && errno != EINTR) {
+			PANIC(errno, "poll");
+		}
+
+		if (r > 0 && (pollfds[1].revents & POLLIN)) {
+			break;
+		}
+
+		my3status_heartbeat(m);
+
+		bool rescan = false;
+		bool relevant = (r > 0 && uevent_read(fd, &rescan));
+
+		if (rescan) {
+			close_supplies();
+			scan_supplies();
+		}
+
+		int64_t now = my3status_now_ms();
+		if (now >= fallback_at) {
+			fallback_at = now + interval * 1000;
+		} else if (!relevant) {
+			continue;
+		}
+
+		print_state(m);
+	}
+
+	close_supplies();
+	close(fd);
+	free(supply_dir);
+
+	return NULL;
+}
+
+static int uevent_open()
+{
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (fd == -1) {
+		PANIC(errno, "socket");
+	}
+
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1 // kernel events, as opposed to udev's
+	};
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		PANIC(errno, "bind");
+	}
+
+	return fd;
+}
+
+/*
+ * Drains pending uevents. Returns true if any of them were about a power
+ * supply, and sets `rescan` if a supply came or went.
+ */
+static bool uevent_read(int fd, bool *rescan)
+{
+	static char buf[UEVENT_BUF_SIZE];
+	bool relevant = false;
+	ssize_t n;
+
+	while ((n = recv(fd, buf, UEVENT_BUF_SIZE - 1, MSG_DONTWAIT)) > 0) {
+		buf[n] = '\0';
+
+		// "ACTION@DEVPATH" followed by NUL separated KEY=VALUE pairs
+		bool power_supply = false;
+		for (char *p = buf; p < buf + n; p += strlen(p) + 1) {
+			if (strcmp(p, "SUBSYSTEM=power_supply") == 0) {
+				power_supply = true;
+			}
+		}
+
+		if (!power_supply) {
+			continue;
+		}
+
+		relevant = true;
+
+		if (strncmp(buf, "change@", 7) != 0) {
+			*rescan = true;
+		}
+	}
+
+	// dropped events could have been anything
+	if (n == -1 && errno == ENOBUFS) {
+		*rescan = true;
+		return true;
+	}
+
+	if (n == -1 && errno != EAGAIN) {
+		PANIC(errno, "recv");
+	}
+
+	return relevant;
+}
+
+static void scan_supplies()
+{
+	DIR *dir = opendir(supply_dir);
+	if (dir == NULL) {
+		// no power supply class at all, e.g. in a container
+		return;
+	}
+
+	struct dirent *e;
+	while ((e = readdir(dir)) != NULL && supply_count < MAX_SUPPLIES) {
+		if (e->d_name[0] == '.') {
+			continue;
+		}
+
+		int dfd = openat(dirfd(dir), e->d_name, O_PATH | O_DIRECTORY);
+		if (dfd == -1) {
+			continue;
+		}
+
+		char type[32];
+		int type_fd = open_attr(dfd, "type");
+		bool have_type = read_attr(type_fd, type, sizeof(type));
+		if (type_fd != -1) {
+			close(type_fd);
+		}
+
+		struct supply s = {
+			.online_fd = -1, .capacity_fd = -1, .status_fd = -1
+		};
+
+		if (have_type && strcmp(type, "Battery") == 0) {
+			s.is_battery = true;
+			s.capacity_fd = open_attr(dfd, "capacity");
+			s.status_fd = open_attr(dfd, "status");
+		} else if (have_type && strcmp(type, "Mains") == 0) {
+			s.online_fd = open_attr(dfd, "online");
+		}
+
+		close(dfd);
+
+		if (s.capacity_fd != -1 || s.online_fd != -1) {
+			supplies[supply_count++] = s;
+		} else if (s.status_fd != -1) {
+			close(s.status_fd);
+		}
+	}
+
+	closedir(dir);
+}
+
+static void close_supplies()
+{
+	for (int i = 0; i < supply_count; i += 1) {
+		struct supply *s = &supplies[i];
+
+		if (s->online_fd != -1) close(s->online_fd);
+		if (s->capacity_fd != -1) close(s->capacity_fd);
+		if (s->status_fd != -1) close(s->status_fd);
+	}
+
+	supply_count = 0;
+}
+
+static int open_attr(int dfd, const char *name)
+{
+	return openat(dfd, name, O_RDONLY | O_CLOEXEC);
+}
+
+static bool read_attr(int fd, char *buf, size_t size)
+{
+	if (fd == -1) {
+		return false;
+	}
+
+	ssize_t n = pread(fd, buf, size - 1, 0);
+	if (n <= 0) {
+		return false;
+	}
+
+	if (buf[n - 1] == '\n') {
+		n -= 1;
+	}
+
+	buf[n] = '\0';
+	return true;
+}
+
+static long read_long(int fd)
+{
+	char buf[32];
+
+	if (!read_attr(fd, buf, sizeof(buf))) {
+		return -1;
+	}
+
+	return strtol(buf, NULL, 10);
+}
+
+static void print_state(struct my3status_module *m)
+{
+	long capacity_sum = 0;
+	int batteries = 0;
+	bool plugged = false;
+
+	for (int i = 0; i < supply_count; i += 1) {
+		struct supply *s = &supplies[i];
+
+		if (!s->is_battery) {
+			plugged |= (read_long(s->online_fd) == 1);
+			continue;
+		}
+
+		long capacity = read_long(s->capacity_fd);
+		if (capacity < 0) {
+			continue;
+		}
+
+		capacity_sum += capacity;
+		batteries += 1;
+
+		char status[32];
+		if (read_attr(s->status_fd, status, sizeof(status)) &&
+		    strcmp(status, "Charging") == 0)
+		{
+			plugged = true;
+		}
+	}
+
+	// a desktop on mains power has nothing worth showing
+	bool visible = (batteries > 0);
+
+	union my3status_format_value values[2] = {
+		[SOURCE]	= { .i = plugged ? 1 : 0 },
+		[CAPACITY]	= { .i = batteries > 0 ? capacity_sum / batteries : 0 },
+	};
+
+	if (visible == m->output_visible &&
+	    !my3status_format_changed(format, values))
+	{
+		return;
+	}
+
+	my3status_output_begin(m);
+	m->output_visible = visible;
+	my3status_format_render(format, values, output, MAX_OUTPUT);
+	my3status_output_done(m);
+}
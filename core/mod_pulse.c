@@ -6,6 +6,20 @@
 
 static char output[MAX_OUTPUT] = "🔈 ";
 
+enum { SPEAKER, VOLUME };
+
+static const char *const speaker_glyphs[] = { "🔇", "🔈", "🔉", "🔊" };
+
+static const struct my3status_format_field fields[] = {
+	[SPEAKER] = {
+		.name = "speaker", .type = MY3STATUS_FORMAT_GLYPH,
+		.glyphs = speaker_glyphs, .glyph_count = 4
+	},
+	[VOLUME] = { .name = "volume", .type = MY3STATUS_FORMAT_PERCENT },
+};
+
+static struct my3status_format *format;
+
 static void on_context_state_change(pa_context *, void *);
 static void on_subscribed(pa_context *, int, void *);
 static void on_state_change(pa_context *, pa_subscription_event_type_t,
@@ -13,8 +27,12 @@ static void on_state_change(pa_context *, pa_subscription_event_type_t,
 static void on_server_info(pa_context *, const pa_server_info *, void *);
 static void on_sink_info(pa_context *, const pa_sink_info *, int, void *);
 
-int mod_pulse_init(struct my3status_state *s)
+void my3status_module_init(struct my3status_state *s)
 {
+	format = my3status_format_compile(
+		"pulse", "{speaker} {volume}", fields, 2
+	);
+
 	struct my3status_module *m =
 		my3status_register_module(s, "pulse", output, true);
 
@@ -37,8 +55,6 @@ int mod_pulse_init(struct my3status_state *s)
 	if (r < 0) {
 		error(1, 0, "pa_context_connect failed");
 	}
-
-	return 0;
 }
 
 static void on_context_state_change(pa_context *context, void *userdata) {
@@ -99,20 +115,26 @@ static void on_sink_info(
 	pa_volume_t volume_avg = pa_cvolume_avg(&sink_info->volume);
 	int volume_percent = (int) round((double) volume_avg * 100.0 / PA_VOLUME_NORM);
 
-	my3status_output_begin(m);
+	union my3status_format_value values[2];
 
-	// Integer-dividing the volume by 34 gives an offset we can add to 0x88,
-	// producing the appropriate speaker volume emojis:
+	// Integer-dividing the volume by 34 gives an offset into the speaker
+	// glyphs after the muted one:
 	//
 	//   0% -  33% → 0 (speaker low volume)
 	//  34% -  66% → 1 (speaker medium volume)
 	//  67% - 100% → 2 (speaker high volume)
-	output[3] =
+	values[SPEAKER].i =
 		sink_info->mute
-		? 0x87
-		: 0x88 + MIN(volume_percent / 34, 2);
-	
-	snprintf(output + 5, MAX_OUTPUT - 5, "%d%%", volume_percent);
+		? 0
+		: 1 + MIN(volume_percent / 34, 2);
+
+	values[VOLUME].i = volume_percent;
+
+	if (!my3status_format_changed(format, values)) {
+		return;
+	}
 
+	my3status_output_begin(m);
+	my3status_format_render(format, values, output, MAX_OUTPUT);
 	my3status_output_done(m);
 }
\ No newline at end of file
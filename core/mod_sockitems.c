@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "my3status.h"
+
+#define OUTPUT_MAX 512
+#define ITEMS_SOCKET "sockitems"
+
+#define MAX_ITEMS 32
+#define KEY_MAX 32
+#define VALUE_MAX 128
+
+// datagrams picked up per recvmmsg() call
+#define BATCH_SIZE 16
+#define MESSAGE_MAX 512
+
+struct item {
+	char key[KEY_MAX];
+	char value[VALUE_MAX];
+};
+
+static char output[OUTPUT_MAX] = "";
+
+// kept sorted by key, so the output order matches mod_inoitems
+static struct item items[MAX_ITEMS];
+static int item_count;
+
+static void *run(void *);
+static int init_socket();
+static void apply_message(char *, size_t);
+static void apply_line(char *);
+static void set_item(const char *, const char *);
+static void copy_value(char *, const char *);
+static void print_items(struct my3status_module *);
+
+int mod_sockitems_init(struct my3status_state *s)
+{
+	item_count = 0;
+
+	return my3status_init_internal_module(
+		s, "sockitems", output, false, run
+	);
+}
+
+static void *run(void *arg)
+{
+	struct my3status_module *m = arg;
+
+	int fd = init_socket();
+
+	static char bufs[BATCH_SIZE][MESSAGE_MAX];
+	struct iovec iovecs[BATCH_SIZE];
+	struct mmsghdr msgs[BATCH_SIZE];
+
+	struct pollfd pollfds[] = {
+		(struct pollfd) { .fd = fd, .events = POLLIN },
+		(struct pollfd) { .fd = m->stop_fd, .events = POLLIN },
+	};
+
+	while (1) {
+		if (poll(pollfds, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			PANIC(errno, "poll");
+		}
+
+		if (pollfds[1].revents & POLLIN) {
+			break;
+		}
+
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < BATCH_SIZE; i += 1) {
+			iovecs[i].iov_base = bufs[i];
+			iovecs[i].iov_len = MESSAGE_MAX - 1;
+			msgs[i].msg_hdr.msg_iov = &iovecs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		// take whatever is queued
+		int n = recvmmsg(fd, msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+		if (n == -1) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+
+			PANIC(errno, "recvmmsg");
+		}
+
+		for (int i = 0; i < n; i += 1) {
+			// half a message could set half a value
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				error(0, 0, "sockitems: message longer than %d "
+				      "bytes, dropped", MESSAGE_MAX - 1);
+				continue;
+			}
+
+			apply_message(bufs[i], msgs[i].msg_len);
+		}
+
+		print_items(m);
+	}
+
+	close(fd);
+
+	return NULL;
+}
+
+static int init_socket()
+{
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir == NULL) {
+		PANIC(0, "XDG_RUNTIME_DIR not set");
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	int len = snprintf(addr.sun_path, sizeof(addr.sun_path),
+			   "%s/" ITEMS_SOCKET, runtime_dir);
+	if (len < 0 || (size_t) len >= sizeof(addr.sun_path)) {
+		PANIC(0, "socket path too long");
+	}
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		PANIC(errno, "socket");
+	}
+
+	// a stale socket from a previous run would make bind() fail
+	if (unlink(addr.sun_path) == -1 && errno != ENOENT) {
+		PANIC(errno, "unlink failed: %s", addr.sun_path);
+	}
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		PANIC(errno, "bind failed: %s", addr.sun_path);
+	}
+
+	return fd;
+}
+
+/*
+ * A message is one or more `key=value` lines. An empty value removes the
+ * item.
+ */
+static void apply_message(char *msg, size_t len)
+{
+	msg[len] = '\0';
+
+	char *saveptr;
+	for (char *line = strtok_r(msg, "\n", &saveptr);
+	     line != NULL;
+	     line = strtok_r(NULL, "\n", &saveptr))
+	{
+		apply_line(line);
+	}
+}
+
+static void apply_line(char *line)
+{
+	char *value = strchr(line, '=');
+	if (value == NULL || value == line) {
+		error(0, 0, "sockitems: malformed message: %s", line);
+		return;
+	}
+
+	*value++ = '\0';
+
+	if (strlen(line) >= KEY_MAX) {
+		error(0, 0, "sockitems: key too long: %s", line);
+		return;
+	}
+
+	// the core doesn't escape full_text, so keep quotes and backslashes out
+	for (char *c = value; *c != '\0'; c += 1) {
+		if (*c == '"' || *c == '\\' || (unsigned char) *c < 0x20) {
+			*c = '?';
+		}
+	}
+
+	set_item(line, value);
+}
+
+static void set_item(const char *key, const char *value)
+{
+	int i = 0;
+	int cmp = 1;
+
+	while (i < item_count && (cmp = strcmp(items[i].key, key)) < 0) {
+		i += 1;
+	}
+
+	bool exists = (i < item_count && cmp == 0);
+
+	if (*value == '\0') {
+		if (exists) {
+			memmove(&items[i], &items[i + 1],
+				(item_count - i - 1) * sizeof(struct item));
+			item_count -= 1;
+		}
+
+		return;
+	}
+
+	if (!exists) {
+		if (item_count == MAX_ITEMS) {
+			error(0, 0, "sockitems: too many items, dropping %s", key);
+			return;
+		}
+
+		memmove(&items[i + 1], &items[i],
+			(item_count - i) * sizeof(struct item));
+		item_count += 1;
+
+		strcpy(items[i].key, key);
+	}
+
+	copy_value(items[i].value, value);
+}
+
+/*
+ * Cuts values at VALUE_MAX, but not in the middle of a UTF-8 sequence.
+ */
+static void copy_value(char *dst, const char *value)
+{
+	size_t len = strlen(value);
+
+	if (len >= VALUE_MAX) {
+		len = VALUE_MAX - 1;
+
+		// value[len] is the first byte left out; while it continues a
+		// sequence, leave out the start of that sequence too
+		while (len > 0 && ((unsigned char) value[len] & 0xc0) == 0x80) {
+			len -= 1;
+		}
+	}
+
+	memcpy(dst, value, len);
+	dst[len] = '\0';
+}
+
+static void print_items(struct my3status_module *m)
+{
+	my3status_output_begin(m);
+
+	char *output_ptr = output;
+	char *output_end = output + OUTPUT_MAX;
+
+	*output_ptr = '\0';
+	for (int i = 0; i < item_count && output_ptr < output_end; i += 1) {
+		output_ptr += snprintf(
+			output_ptr, output_end - output_ptr, "%s%s",
+			i == 0 ? "" : "/", items[i].value
+		);
+	}
+
+	m->output_visible = (item_count > 0);
+
+	my3status_output_done(m);
+}
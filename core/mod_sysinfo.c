@@ -6,10 +6,27 @@
 
 static char output[MAX_OUTPUT] = "🐧 ";
 
+enum { LOAD, DAYS, HOURS };
+
+static const struct my3status_format_field fields[] = {
+	[LOAD]	= { .name = "load", .type = MY3STATUS_FORMAT_FIXED, .decimals = 2 },
+	[DAYS]	= { .name = "days", .type = MY3STATUS_FORMAT_INT },
+	[HOURS]	= { .name = "hours", .type = MY3STATUS_FORMAT_INT },
+};
+
+static struct my3status_format *format;
+
 static void *run(void *);
 
 int mod_sysinfo_init(struct my3status_state *s)
 {
+	// a reload can start the module again
+	if (format == NULL) {
+		format = my3status_format_compile(
+			"sysinfo", "🐧 {load} {days}d {hours}h", fields, 3
+		);
+	}
+
 	return my3status_init_internal_module(
 		s, "sysinfo", output, true, run
 	);
@@ -20,44 +37,39 @@ void *run(void *arg)
 	struct my3status_module *m = arg;
 	struct sysinfo s;
 
-	float	load_5min, previous_load_5min = -1.0f;
-	long	up_hours, previous_up_hours = -1L;
-	long	up_days, previous_up_days = -1L;
+	union my3status_format_value values[3];
+	long up_hours;
+
+	my3status_set_deadline(m, 60);
 
 	while (1) {
 		if (sysinfo(&s) != 0) {
 			error(1, errno, "sysinfo");
 		}
 
-		load_5min = s.loads[0] / (float) (1 << SI_LOAD_SHIFT);
+		// load in hundredths, rounded
+		values[LOAD].i =
+			((uint64_t) s.loads[0] * 100 + (1 << (SI_LOAD_SHIFT - 1)))
+			>> SI_LOAD_SHIFT;
 
-		up_hours  = s.uptime / 3600;
-		up_days	  = up_hours / 24;
-		up_hours -= up_days  * 24;
+		up_hours	= s.uptime / 3600;
+		values[DAYS].i	= up_hours / 24;
+		values[HOURS].i	= up_hours % 24;
 
-		if (
-			load_5min == previous_load_5min &&
-			up_days == previous_up_days &&
-			up_hours == previous_up_hours
-		) {
+		if (!my3status_format_changed(format, values)) {
 			goto sleep;
 		}
 
 		my3status_output_begin(m);
-		snprintf(
-			output + 5, MAX_OUTPUT - 5, "%.2f %ldd %ldh",
-			load_5min, up_days, up_hours
-		);
+		my3status_format_render(format, values, output, MAX_OUTPUT);
 		my3status_output_done(m);
-
-		previous_load_5min = load_5min;
-		previous_up_days = up_days;
-		previous_up_hours = up_hours;
 	
 	sleep:
-		sleep(10);
+		my3status_heartbeat(m);
+		if (!my3status_sleep(m, 10)) {
+			break;
+		}
 	}
 
-	// should be unreachable
 	return NULL;
 }
\ No newline at end of file
@@ -1,30 +1,160 @@
-#include <assert.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include "my3status.h"
 
-static void append_module(
+// which module start the modules registered by this thread belong to, and
+// where on the bar they go
+static __thread unsigned init_instance;
+static __thread unsigned init_slot;
+
+static struct my3status_module *take_entry(struct my3status_state *);
+static bool any_stopping(struct my3status_state *, const char *);
+static void insert_in_order(struct my3status_state *, unsigned);
+static void index_names(struct my3status_state *);
+static void *run_module(void *);
+
+/*
+ * Returns NULL if the registry is full. With `wait`, waits for modules that
+ * are stopping to make room first.
+ */
+static struct my3status_module *new_module(
 	struct my3status_state	*state,
-	struct my3status_module	*module
+	const char		*name,
+	bool			 wait
 ) {
-	assert(state->first_module == NULL || state->last_module != NULL);
+	if (state->modules == NULL) {
+		state->modules = calloc(MY3STATUS_MAX_MODULES,
+					sizeof(struct my3status_module));
+		if (state->modules == NULL) {
+			error(1, errno, "calloc");
+		}
+	}
 
-	struct my3status_module_node *item
-		= malloc(sizeof(struct my3status_module_node));
-	if (item == NULL) {
-		error(1, errno, "malloc");
+	struct my3status_module *m;
+	while ((m = take_entry(state)) == NULL) {
+		if (!wait || !any_stopping(state, NULL)) {
+			return NULL;
+		}
+
+		pthread_cond_wait(&state->modules_cond, &state->modules_mutex);
 	}
 
-	item->module = module;
-	item->next = NULL;
+	m->state = state;
+	m->name = name;
+	m->instance = init_instance;
+	m->slot = init_slot;
+	m->heartbeat = my3status_now_ms();
+	m->sequence = 1;
+	m->stop_fd = -1;
 
-	struct my3status_module_node **dest_ptr;
-	if (state->first_module == NULL) {
-		dest_ptr = &state->first_module;
-	} else {
-		dest_ptr = &state->last_module->next;
+	insert_in_order(state, m->index);
+
+	return m;
+}
+
+/*
+ * Finds an entry for a new module, preferring one a stopped module left.
+ * Those keep their buffers, which the main thread may still point to.
+ */
+static struct my3status_module *take_entry(struct my3status_state *state)
+{
+	for (unsigned i = 0; i < state->module_count; i += 1) {
+		struct my3status_module *m = &state->modules[i];
+
+		if (!m->vacant) {
+			continue;
+		}
+
+		struct my3status_buf fragment = m->fragment;
+		struct my3status_buf last_output = m->last_output;
+
+		pthread_mutex_destroy(&m->output_mutex);
+		*m = (struct my3status_module) {
+			.index = i, .fragment = fragment,
+			.last_output = last_output
+		};
+
+		m->fragment.len = 0;
+		m->last_output.len = 0;
+
+		if (pthread_mutex_init(&m->output_mutex, NULL) != 0) {
+			error(1, errno, "pthread_mutex_init");
+		}
+
+		return m;
 	}
 
-	*dest_ptr = item;
-	state->last_module = item;
+	if (state->module_count == MY3STATUS_MAX_MODULES) {
+		return NULL;
+	}
+
+	struct my3status_module *m = &state->modules[state->module_count];
+	m->index = state->module_count;
+
+	if (pthread_mutex_init(&m->output_mutex, NULL) != 0) {
+		error(1, errno, "pthread_mutex_init");
+	}
+
+	state->module_count += 1;
+	return m;
+}
+
+/*
+ * Tells whether a module named `name`, or any if NULL, has been asked to
+ * stop and hasn't yet. Called with modules_mutex held.
+ */
+static bool any_stopping(struct my3status_state *state, const char *name)
+{
+	for (unsigned i = 0; i < state->module_count; i += 1) {
+		struct my3status_module *m = &state->modules[i];
+
+		if (m->stopping &&
+		    (name == NULL || strcmp(m->name, name) == 0))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Puts a module on the bar after every module of the same or an earlier slot.
+ */
+static void insert_in_order(struct my3status_state *state, unsigned index)
+{
+	unsigned slot = state->modules[index].slot;
+
+	unsigned pos = 0;
+	while (pos < state->order_count &&
+	       state->modules[state->order[pos]].slot <= slot)
+	{
+		pos += 1;
+	}
+
+	memmove(&state->order[pos + 1], &state->order[pos],
+		state->order_count - pos);
+	state->order[pos] = index;
+	state->order_count += 1;
+}
+
+static struct my3status_module *claim_placeholder(
+	struct my3status_state	*state,
+	const char		*name
+) {
+	for (unsigned i = 0; i < state->module_count; i += 1) {
+		struct my3status_module *m = &state->modules[i];
+
+		if (m->placeholder && !m->vacant &&
+		    m->instance == init_instance &&
+		    strcmp(m->name, name) == 0)
+		{
+			return m;
+		}
+	}
+
+	return NULL;
 }
 
 struct my3status_module *my3status_register_module(
@@ -33,25 +163,317 @@ struct my3status_module *my3status_register_module(
 	const char		*output,
 	bool			 visible
 ) {
-	struct my3status_module *m = calloc(1, sizeof(struct my3status_module));
+	pthread_mutex_lock(&state->modules_mutex);
+
+	if (state->frozen) {
+		error(1, 0, "module registered after startup: %s", name);
+	}
+
+	struct my3status_module *m = claim_placeholder(state, name);
 	if (m == NULL) {
-		error(1, errno, "calloc");
+		m = new_module(state, name, true);
 	}
 
-	if (pthread_mutex_init(&m->output_mutex, NULL) != 0) {
-		error(1, errno, "pthread_mutex_init");
+	if (m == NULL) {
+		error(1, 0, "too many modules, can't add %s", name);
 	}
-	
-	m->state = state;
+
+	pthread_mutex_lock(&m->output_mutex);
 	m->name = name;
 	m->output = output;
 	m->output_visible = visible;
+	m->placeholder = false;
+	m->registered_at = my3status_now_ms();
+	m->sequence += 1;
+	my3status_budget_init(m);
+	my3status_trace_module(m);
+	pthread_mutex_unlock(&m->output_mutex);
 
-	append_module(state, m);
+	pthread_mutex_unlock(&state->modules_mutex);
 
 	return m;
 }
 
+void my3status_set_init_slot(unsigned instance, unsigned slot)
+{
+	init_instance = instance;
+	init_slot = slot;
+}
+
+/*
+ * Holds a module's place with its output from the previous run until the
+ * module itself registers.
+ */
+void my3status_register_placeholder(
+	struct my3status_state	*state,
+	const char		*name,
+	const char		*cached_output
+) {
+	pthread_mutex_lock(&state->modules_mutex);
+
+	// the module itself gets an entry once there's room, the cached
+	// output is only nice to have
+	struct my3status_module *m = new_module(state, name, false);
+	if (m != NULL) {
+		m->output = "";
+		m->placeholder = true;
+		m->cached_output = cached_output;
+	}
+
+	pthread_mutex_unlock(&state->modules_mutex);
+}
+
+/*
+ * Takes placeholders that no module claimed off the bar once every module
+ * has started, and frees their entries.
+ */
+void my3status_drop_placeholders(struct my3status_state *state)
+{
+	pthread_mutex_lock(&state->modules_mutex);
+
+	unsigned kept = 0;
+	for (unsigned i = 0; i < state->order_count; i += 1) {
+		struct my3status_module *m = &state->modules[state->order[i]];
+
+		if (m->placeholder) {
+			m->retired = true;
+			m->vacant = true;
+			continue;
+		}
+
+		state->order[kept++] = state->order[i];
+	}
+
+	state->order_count = kept;
+
+	pthread_mutex_unlock(&state->modules_mutex);
+}
+
+/*
+ * Walks of the registry are bracketed by these. Once the registry is frozen
+ * they cost nothing.
+ */
+bool my3status_lock_modules(struct my3status_state *state)
+{
+	if (atomic_load_explicit(&state->frozen, memory_order_acquire)) {
+		return false;
+	}
+
+	pthread_mutex_lock(&state->modules_mutex);
+	return true;
+}
+
+void my3status_unlock_modules(struct my3status_state *state, bool locked)
+{
+	if (locked) {
+		pthread_mutex_unlock(&state->modules_mutex);
+	}
+}
+
+/*
+ * Builds the name index and stops any further changes to the registry.
+ */
+void my3status_freeze_modules(struct my3status_state *state)
+{
+	pthread_mutex_lock(&state->modules_mutex);
+
+	index_names(state);
+
+	atomic_store_explicit(&state->frozen, true, memory_order_release);
+
+	pthread_mutex_unlock(&state->modules_mutex);
+}
+
+/*
+ * Lets modules register again, for a reload that starts new ones.
+ */
+void my3status_unfreeze_modules(struct my3status_state *state)
+{
+	pthread_mutex_lock(&state->modules_mutex);
+	atomic_store_explicit(&state->frozen, false, memory_order_release);
+	pthread_mutex_unlock(&state->modules_mutex);
+}
+
+/*
+ * Moves modules to the slots a reload gave their instances, indexed by
+ * instance. Modules of instances with a negative slot leave the bar; unless
+ * they were stopped, their threads carry on, but nothing they do is shown any
+ * more.
+ */
+void my3status_arrange_modules(
+	struct my3status_state	*state,
+	const int		*slots
+) {
+	pthread_mutex_lock(&state->modules_mutex);
+
+	state->order_count = 0;
+
+	for (unsigned i = 0; i < state->module_count; i += 1) {
+		struct my3status_module *m = &state->modules[i];
+
+		// a new instance may have taken over a stopped one's number
+		int slot = (m->stopping || m->vacant) ? -1 : slots[m->instance];
+
+		m->retired = (slot < 0);
+		if (m->retired) {
+			continue;
+		}
+
+		m->slot = slot;
+		insert_in_order(state, i);
+	}
+
+	index_names(state);
+
+	pthread_mutex_unlock(&state->modules_mutex);
+}
+
+/*
+ * Tells whether every module of an instance can be stopped.
+ */
+bool my3status_can_stop_instance(
+	struct my3status_state	*state,
+	unsigned		 instance
+) {
+	bool stoppable = true;
+
+	pthread_mutex_lock(&state->modules_mutex);
+
+	for (unsigned i = 0; i < state->module_count; i += 1) {
+		struct my3status_module *m = &state->modules[i];
+
+		if (m->instance == instance && !m->stopping && !m->vacant &&
+		    m->stop_fd == -1)
+		{
+			stoppable = false;
+		}
+	}
+
+	pthread_mutex_unlock(&state->modules_mutex);
+
+	return stoppable;
+}
+
+/*
+ * Asks the modules of an instance to stop, once my3status_can_stop_instance()
+ * said they all can. They're off the bar right away; their entries are freed
+ * as their threads return.
+ */
+void my3status_stop_instance(struct my3status_state *state, unsigned instance)
+{
+	pthread_mutex_lock(&state->modules_mutex);
+
+	for (unsigned i = 0; i < state->module_count; i += 1) {
+		struct my3status_module *m = &state->modules[i];
+
+		if (m->instance != instance || m->stopping || m->vacant) {
+			continue;
+		}
+
+		m->retired = true;
+		m->stopping = true;
+
+		if (eventfd_write(m->stop_fd, 1) == -1) {
+			error(1, errno, "eventfd_write");
+		}
+	}
+
+	pthread_mutex_unlock(&state->modules_mutex);
+}
+
+/*
+ * Modules keep their state in globals, so one that's coming back waits for
+ * its previous run to be over.
+ */
+void my3status_wait_for_stopped(
+	struct my3status_state	*state,
+	const char		*name
+) {
+	pthread_mutex_lock(&state->modules_mutex);
+
+	while (any_stopping(state, name)) {
+		pthread_cond_wait(&state->modules_cond, &state->modules_mutex);
+	}
+
+	pthread_mutex_unlock(&state->modules_mutex);
+}
+
+/*
+ * Sorts the modules on the bar by name into `by_name`. Insertion sort, as
+ * there are at most MY3STATUS_MAX_MODULES.
+ */
+static void index_names(struct my3status_state *state)
+{
+	for (unsigned i = 0; i < state->order_count; i += 1) {
+		unsigned index = state->order[i];
+		const char *name = state->modules[index].name;
+
+		unsigned j = i;
+		while (j > 0 &&
+		       strcmp(state->modules[state->by_name[j - 1]].name,
+			      name) > 0)
+		{
+			state->by_name[j] = state->by_name[j - 1];
+			j -= 1;
+		}
+
+		state->by_name[j] = index;
+	}
+}
+
+/*
+ * Binary search once frozen, a plain walk before that. Hidden placeholders
+ * are never found.
+ */
+struct my3status_module *my3status_find_module(
+	struct my3status_state	*state,
+	const char		*name
+) {
+	struct my3status_module *found = NULL;
+
+	if (atomic_load_explicit(&state->frozen, memory_order_acquire)) {
+		unsigned lo = 0, hi = state->order_count;
+
+		while (lo < hi) {
+			unsigned mid = lo + (hi - lo) / 2;
+			struct my3status_module *m =
+				&state->modules[state->by_name[mid]];
+
+			int cmp = strcmp(m->name, name);
+			if (cmp == 0) {
+				found = m;
+				break;
+			}
+
+			if (cmp < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+	} else {
+		pthread_mutex_lock(&state->modules_mutex);
+
+		for (unsigned i = 0; i < state->order_count; i += 1) {
+			struct my3status_module *m =
+				&state->modules[state->order[i]];
+
+			if (strcmp(m->name, name) == 0) {
+				found = m;
+				break;
+			}
+		}
+
+		pthread_mutex_unlock(&state->modules_mutex);
+	}
+
+	if (found == NULL || found->placeholder || found->retired) {
+		return NULL;
+	}
+
+	return found;
+}
+
 void my3status_output_begin(struct my3status_module *m)
 {
 	if (pthread_mutex_lock(&m->output_mutex) != 0) {
@@ -61,12 +483,22 @@ void my3status_output_begin(struct my3status_module *m)
 
 void my3status_output_done(struct my3status_module *m)
 {
+	m->updated = true;
+	m->sequence += 1;
+	my3status_heartbeat(m);
+	my3status_trace_output(m);
+
+	// chatty or bulk modules wait for the next scheduled frame
+	bool signal = my3status_budget_take(m);
+
 	if (pthread_mutex_unlock(&m->output_mutex) != 0) {
 		error(1, errno, "pthread_mutex_unlock");
 	}
 
-	//fprintf(stderr, "\t%s triggered update\n", m->name);
-	pthread_kill(m->state->main_thread, SIGUSR1);
+	if (signal) {
+		//fprintf(stderr, "\t%s triggered update\n", m->name);
+		pthread_kill(m->state->main_thread, SIGUSR1);
+	}
 }
 
 int my3status_init_internal_module(
@@ -80,6 +512,16 @@ int my3status_init_internal_module(
 		state, name, output, initially_visible
 	);
 
+	int stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd == -1) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&state->modules_mutex);
+	m->run = run;
+	m->stop_fd = stop_fd;
+	pthread_mutex_unlock(&state->modules_mutex);
+
 	int r;
 
 	pthread_attr_t attrs;
@@ -94,10 +536,82 @@ int my3status_init_internal_module(
 	}
 
 	pthread_t p;
-	r = pthread_create(&p, NULL, run, m);
+	r = pthread_create(&p, &attrs, run_module, m);
+	pthread_attr_destroy(&attrs);
 	if (r != 0) {
 		return -1;
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Runs a module started by my3status_init_internal_module(), and frees its
+ * entry once it returns because it was asked to stop.
+ */
+static void *run_module(void *arg)
+{
+	struct my3status_module *m = arg;
+	struct my3status_state *state = m->state;
+
+	m->run(m);
+
+	pthread_mutex_lock(&state->modules_mutex);
+
+	if (m->stopping) {
+		close(m->stop_fd);
+		m->stop_fd = -1;
+		m->stopping = false;
+		m->vacant = true;
+		pthread_cond_broadcast(&state->modules_cond);
+	}
+
+	pthread_mutex_unlock(&state->modules_mutex);
+
+	return NULL;
+}
+
+bool my3status_sleep(struct my3status_module *m, unsigned seconds)
+{
+	struct pollfd pfd = { .fd = m->stop_fd, .events = POLLIN };
+
+	int r = poll(&pfd, 1, seconds * 1000);
+	if (r == -1 && errno != EINTR) {
+		error(1, errno, "poll");
+	}
+
+	return r <= 0;
+}
+
+void my3status_set_deadline(struct my3status_module *m, unsigned seconds)
+{
+	atomic_store_explicit(&m->deadline, seconds, memory_order_relaxed);
+	my3status_heartbeat(m);
+}
+
+void my3status_heartbeat(struct my3status_module *m)
+{
+	atomic_store_explicit(&m->heartbeat, my3status_now_ms(),
+			      memory_order_relaxed);
+}
+
+void my3status_count_reconnect(struct my3status_module *m)
+{
+	atomic_fetch_add_explicit(&m->reconnects, 1, memory_order_relaxed);
+}
+
+void my3status_count_resumed(struct my3status_module *m)
+{
+	atomic_fetch_add_explicit(&m->resumed, 1, memory_order_relaxed);
+}
+
+int64_t my3status_now_ms()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		error(1, errno, "clock_gettime");
+	}
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -2,6 +2,9 @@
 
 // headers for declarations in this file
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
 
 // headers commonly used by modules
 #include <errno.h>
@@ -19,37 +22,143 @@
                 __func__, __LINE__ __VA_OPT__(,) __VA_ARGS__ \
         )
 
+#define MY3STATUS_ALL_MODULES UINT64_MAX
+
+// each module gets a bit in client masks
+#define MY3STATUS_MAX_MODULES 64
+
 struct my3status_module;
 
+/*
+ * What the renderer touches for every module on every frame, packed together
+ * in bar order.
+ */
+struct my3status_hot_module {
+	const char	*fragment;
+	uint32_t	 fragment_len;
+	uint32_t	 sequence;	/* of the output the fragment shows */
+	uint64_t	 bit;		/* in client masks */
+};
+
 /* Main application state */
 struct my3status_state {
 	pthread_t			 main_thread;
 
-	struct my3status_module_node	*first_module;
-	struct my3status_module_node	*last_module;
+	/*
+	 * The module registry. Modules live in one array, so their addresses
+	 * never change; `order` indexes the ones on the bar in bar order and
+	 * `by_name` the same ones sorted by name. Registration takes
+	 * modules_mutex. Once every module has started the registry is
+	 * frozen, and readers no longer need it, until the next reload.
+	 * Entries of modules a reload stopped are reused; modules_cond is
+	 * signalled whenever one comes free.
+	 */
+	pthread_mutex_t			 modules_mutex;
+	pthread_cond_t			 modules_cond;
+	_Atomic bool			 frozen;
+	struct my3status_module		*modules;
+	unsigned			 module_count;
+	uint8_t				 order[MY3STATUS_MAX_MODULES];
+	unsigned			 order_count;
+	uint8_t				 by_name[MY3STATUS_MAX_MODULES];
+
+	/* Owned by the main thread, filled in by my3status_render_fragments() */
+	struct my3status_hot_module	 hot[MY3STATUS_MAX_MODULES];
+	unsigned			 hot_count;
+
+	/* Updates waiting for the next scheduled frame, see budget.c */
+	_Atomic bool			 deferred;
+	int64_t				 rendered_at;
+};
+
+/* Growable string buffer */
+struct my3status_buf {
+	char	*data;
+	size_t	 len;
+	size_t	 size;
 };
 
+/*
+ * The fields up to output_mutex are mirrored by lib-rs; new fields go at the
+ * end.
+ */
 struct my3status_module {
 	struct my3status_state	*state;
 	const char		*name;
 	const char		*output;
 	bool			 output_visible;
 	pthread_mutex_t		 output_mutex;
-};
 
-struct my3status_module_node {
-	struct my3status_module		*module;
-	struct my3status_module_node	*next;
+	/* Owned by the main thread */
+	unsigned		 index;		/* in state->modules */
+	struct my3status_buf	 fragment;
+
+	/* Set up by the core, guarded by output_mutex */
+	unsigned		 slot;		/* position on the command line */
+	bool			 updated;	/* has produced output yet */
+	bool			 placeholder;	/* not claimed by a module yet */
+	const char		*cached_output;	/* from the previous run */
+	int64_t			 registered_at;	/* ms */
+
+	/* Watchdog, see my3status_set_deadline() */
+	_Atomic int64_t		 heartbeat;	/* CLOCK_MONOTONIC, ms */
+	_Atomic unsigned	 deadline;	/* seconds, 0 for none */
+
+	/* Owned by the main thread */
+	struct my3status_buf	 last_output;	/* copied at the last render */
+	bool			 last_visible;
+	int64_t			 busy_since;	/* output_mutex held since, ms */
+	bool			 stale;
+	unsigned		 stale_count;
+
+	/* Update budget, guarded by output_mutex; see budget.c */
+	bool			 immediate;
+	double			 rate;		/* tokens per second */
+	double			 burst;
+	double			 tokens;
+	int64_t			 refilled_at;	/* ms */
+	_Atomic unsigned	 throttled;	/* updates over budget */
+
+	/* See my3status_count_reconnect() */
+	_Atomic unsigned	 reconnects;
+	_Atomic unsigned	 resumed;
+
+	/* Bumped under output_mutex whenever there's something new to show */
+	_Atomic uint32_t	 sequence;
+
+	/* Owned by the main thread */
+	uint32_t		 rendered_sequence;
+	bool			 rendered_stale;
+
+	/* Set up by the core, guarded by modules_mutex */
+	unsigned		 instance;	/* the module start that added it */
+	bool			 retired;	/* dropped from the bar by a reload */
+	void			*(*run)(void *);
+	int			 stop_fd;	/* -1 if the module can't stop */
+	bool			 stopping;	/* asked to by a reload */
+	bool			 vacant;	/* stopped, the entry can be reused */
 };
 
 /*
- * Registers a module. Intended to be called from mod_init_* functions.
+ * Registers a module. Intended to be called from mod_init_* functions, or
+ * from my3status_module_init() in plugins.
+ *
+ * Modules start up concurrently, each on its own thread. The module is
+ * placed according to the slot of the calling thread, so the bar keeps the
+ * order of the command line, or of the module list of the latest reload.
  */
 struct my3status_module *my3status_register_module(
 	struct my3status_state *s, const char *name, const char *output,
 	bool visible
 );
 
+/*
+ * Registers a module and runs `run` on a thread of its own. A reload that
+ * drops the module makes `stop_fd` readable; `run` waits on it along with
+ * whatever else it waits for, releases what it holds and returns, and the
+ * module's place in the registry is freed. Modules registered any other way
+ * can't be stopped; a reload only takes them off the bar.
+ */
 int my3status_init_internal_module(
 	struct my3status_state	*state,
 	const char		*name,
@@ -57,12 +166,234 @@ int my3status_init_internal_module(
 	bool			 initially_visible,
 	void			*(*run)(void *)
 );
+
+/*
+ * Sleeps for `seconds`, or until the module is asked to stop. Returns false
+ * in that case.
+ */
+bool my3status_sleep(struct my3status_module *, unsigned seconds);
+
 int mod_clock_init(struct my3status_state *);
 int mod_df_init(struct my3status_state *);
 int mod_inoitems_init(struct my3status_state *);
-int mod_meds_init(struct my3status_state *);
-int mod_pulse_init(struct my3status_state *);
+int mod_net_init(struct my3status_state *);
+int mod_power_init(struct my3status_state *);
+int mod_sockitems_init(struct my3status_state *);
 int mod_sysinfo_init(struct my3status_state *);
 
+/*
+ * `output` and `output_visible` only change between these two; the renderer
+ * doesn't look at a module again until my3status_output_done().
+ */
 void my3status_output_begin(struct my3status_module *);
 void my3status_output_done(struct my3status_module *);
+
+/*
+ * A module that promises to check in at least every `seconds` seconds is
+ * marked stale in the bar when it doesn't. my3status_output_done() counts as
+ * checking in; modules that only output on change call my3status_heartbeat()
+ * as well.
+ */
+void my3status_set_deadline(struct my3status_module *, unsigned seconds);
+void my3status_heartbeat(struct my3status_module *);
+
+/*
+ * Modules that hold connections to servers count their reconnects, and how
+ * many connections resumed a TLS session, for the shared memory snapshot.
+ */
+void my3status_count_reconnect(struct my3status_module *);
+void my3status_count_resumed(struct my3status_module *);
+
+/*
+ * Output format templates. A format is literal text with {field} references
+ * to the module's field table ("{{" and "}}" for literal braces). It is compiled once
+ * at startup, preferring MY3STATUS_FORMAT_<MODULE> from the environment over
+ * the module's default, and rendered from an array of values indexed like the
+ * field table.
+ */
+enum my3status_format_type {
+	MY3STATUS_FORMAT_INT,
+	MY3STATUS_FORMAT_FIXED,		/* value / 10^decimals */
+	MY3STATUS_FORMAT_PERCENT,
+	MY3STATUS_FORMAT_DURATION,	/* seconds, as H:MM or Nd */
+	MY3STATUS_FORMAT_GLYPH,		/* index into glyphs */
+	MY3STATUS_FORMAT_STRING,
+};
+
+struct my3status_format_field {
+	const char			*name;
+	enum my3status_format_type	 type;
+	int				 decimals;
+	const char *const		*glyphs;
+	size_t				 glyph_count;
+};
+
+union my3status_format_value {
+	int64_t		 i;
+	const char	*s;
+};
+
+struct my3status_format;
+
+struct my3status_format *my3status_format_compile(
+	const char *module_name, const char *default_format,
+	const struct my3status_format_field *fields, size_t field_count
+);
+
+/*
+ * Tells whether rendering `values` would produce different output than the
+ * previous render.
+ */
+bool my3status_format_changed(const struct my3status_format *,
+			      const union my3status_format_value *values);
+
+/*
+ * Renders into `out`, starting at the first field that changed since the
+ * previous render into the same buffer. Returns the output length, or 0 if
+ * nothing changed.
+ */
+size_t my3status_format_render(struct my3status_format *,
+			       const union my3status_format_value *values,
+			       char *out, size_t size);
+
+/*
+ * Time zones other than the local one, read without touching TZ; see tz.c.
+ */
+struct my3status_tz;
+
+struct my3status_tz *my3status_tz_load(const char *name);
+void my3status_tz_free(struct my3status_tz *);
+long my3status_tz_offset(const struct my3status_tz *, time_t t,
+			 time_t *until);
+
+/*
+ * Latest module outputs, published by the core into a shared memory file
+ * under XDG_RUNTIME_DIR. Other programs can read consistent snapshots of it
+ * without any syscalls once the file is mapped. With several instances
+ * running, the first one to start publishes.
+ */
+#define MY3STATUS_SHM_MODULES 64
+#define MY3STATUS_SHM_NAME_MAX 32
+#define MY3STATUS_SHM_OUTPUT_MAX 512
+
+struct my3status_shm;
+
+struct my3status_snapshot_module {
+	char		name[MY3STATUS_SHM_NAME_MAX];
+	char		output[MY3STATUS_SHM_OUTPUT_MAX];
+	bool		visible;
+	bool		stale;
+	uint32_t	stale_count;	/* times the watchdog flagged it */
+	uint32_t	throttled;	/* updates that went over budget */
+	uint32_t	reconnects;
+	uint32_t	resumed;	/* TLS sessions resumed */
+};
+
+struct my3status_snapshot {
+	uint32_t				module_count;
+	struct my3status_snapshot_module	modules[MY3STATUS_SHM_MODULES];
+};
+
+struct my3status_shm *my3status_shm_open();
+void my3status_shm_close(struct my3status_shm *);
+
+/*
+ * Copies the current outputs into `snapshot` and stores the sequence number
+ * they were published under in `sequence`, if not NULL. Cheap to poll with
+ * my3status_shm_sequence(). Returns 0, or -1 with errno set to EAGAIN if the
+ * publisher stayed in the middle of an update for 100 ms, which means it
+ * died there; `snapshot` is garbage then. Once a new instance publishes,
+ * reads succeed again.
+ */
+int my3status_shm_read(const struct my3status_shm *,
+		       struct my3status_snapshot *snapshot,
+		       uint32_t *sequence);
+uint32_t my3status_shm_sequence(const struct my3status_shm *);
+
+/*
+ * Traces, recorded with MY3STATUS_TRACE=path and played back with
+ * `my3status --replay path [speed]`. A header, then records, each followed by
+ * `len` bytes: the module name for MODULE records and the output for OUTPUT
+ * records. Native byte order, as traces are replayed where they were taken.
+ */
+#define MY3STATUS_TRACE_MAGIC 0x656361727433796d // "my3trace"
+#define MY3STATUS_TRACE_VERSION 1
+
+enum {
+	MY3STATUS_TRACE_MODULE = 1,
+	MY3STATUS_TRACE_OUTPUT = 2,
+};
+
+struct my3status_trace_header {
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	reserved;
+};
+
+struct my3status_trace_record {
+	int64_t		time_ns;	/* CLOCK_MONOTONIC, from trace start */
+	uint8_t		type;
+	uint8_t		visible;
+	uint16_t	module;		/* index in the registry */
+	uint32_t	len;
+};
+
+/*
+ * Core internals, used by main.c
+ */
+// how often the watchdog looks for stalled modules
+#define MY3STATUS_WATCHDOG_INTERVAL_MS 1000
+
+// how often deferred updates make it into a frame
+#define MY3STATUS_FRAME_INTERVAL_MS 500
+
+bool my3status_wait_for_signals(int sfd, int timeout_ms);
+int my3status_reload(struct my3status_state *, int count, char **names);
+int my3status_module_list(char **names);
+bool my3status_handle_sighup(struct my3status_state *);
+bool my3status_watchdog(struct my3status_state *);
+int64_t my3status_now_ms();
+
+bool my3status_lock_modules(struct my3status_state *);
+void my3status_unlock_modules(struct my3status_state *, bool locked);
+void my3status_freeze_modules(struct my3status_state *);
+void my3status_unfreeze_modules(struct my3status_state *);
+void my3status_arrange_modules(struct my3status_state *, const int *slots);
+bool my3status_can_stop_instance(struct my3status_state *, unsigned instance);
+void my3status_stop_instance(struct my3status_state *, unsigned instance);
+void my3status_wait_for_stopped(struct my3status_state *, const char *name);
+struct my3status_module *my3status_find_module(struct my3status_state *,
+					       const char *name);
+
+void my3status_set_init_slot(unsigned instance, unsigned slot);
+void my3status_register_placeholder(struct my3status_state *,
+				    const char *name, const char *cached_output);
+void my3status_drop_placeholders(struct my3status_state *);
+
+void my3status_budget_init(struct my3status_module *);
+bool my3status_budget_take(struct my3status_module *);
+int my3status_frame_timeout(struct my3status_state *, int max_ms);
+bool my3status_frame_due(struct my3status_state *);
+
+void my3status_trace_start();
+void my3status_trace_module(const struct my3status_module *);
+void my3status_trace_output(const struct my3status_module *);
+int my3status_replay_run(struct my3status_state *, int sfd,
+			 int argc, char **argv);
+
+void my3status_cache_load();
+const char *my3status_cache_lookup(const char *name);
+void my3status_cache_save(struct my3status_state *);
+
+void my3status_render_fragments(struct my3status_state *);
+size_t my3status_render_line(struct my3status_state *, uint64_t mask,
+			     struct my3status_buf *line);
+
+int my3status_shm_create();
+void my3status_shm_publish_begin();
+void my3status_shm_publish_module(const struct my3status_module *);
+void my3status_shm_publish_end();
+
+void my3status_serve(struct my3status_state *, int sfd);
+int my3status_client_run(int argc, char **argv);
+void my3status_persist(int argc, char **argv);
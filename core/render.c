@@ -0,0 +1,276 @@
+#include <stdarg.h>
+#include "my3status.h"
+
+// nobody holds output_mutex this long unless something's wrong
+#define LOCK_DEADLINE_MS 2000
+
+// a module that stays quiet this long after registering has nothing to say,
+// and its output from the last run isn't news anymore
+#define CACHED_OUTPUT_MS 5000
+
+// shown in front of the last output of a stalled module
+#define STALE_MARKER "⏳ "
+#define STALE_COLOR "#808080"
+
+static void copy_output(struct my3status_module *);
+static void render_fragment(struct my3status_module *);
+
+static void buf_reserve(struct my3status_buf *, size_t);
+static void buf_printf(struct my3status_buf *, const char *, ...);
+static void buf_append(struct my3status_buf *, const char *, size_t);
+
+void my3status_render_fragments(struct my3status_state *state)
+{
+	struct my3status_module		*m;
+	struct my3status_hot_module	*hot;
+
+	// anything deferred from here on is left for the next frame
+	atomic_store_explicit(&state->deferred, false, memory_order_release);
+	state->rendered_at = my3status_now_ms();
+
+	bool locked = my3status_lock_modules(state);
+	my3status_shm_publish_begin();
+
+	for (unsigned i = 0; i < state->order_count; i += 1) {
+		m = &state->modules[state->order[i]];
+
+		uint32_t sequence = atomic_load_explicit(
+			&m->sequence, memory_order_acquire
+		);
+
+		// with nothing new, the module's lock isn't even touched
+		bool changed = (sequence != m->rendered_sequence);
+
+		// a module stuck holding its lock keeps its last output rather
+		// than freezing the whole bar
+		if (changed &&
+		    pthread_mutex_trylock(&m->output_mutex) == 0)
+		{
+			m->busy_since = 0;
+			m->rendered_sequence = m->sequence;
+			copy_output(m);
+			pthread_mutex_unlock(&m->output_mutex);
+		} else if (changed && m->busy_since == 0) {
+			m->busy_since = my3status_now_ms();
+		}
+
+		if (changed || m->stale != m->rendered_stale) {
+			m->rendered_stale = m->stale;
+			render_fragment(m);
+		}
+
+		hot = &state->hot[i];
+		hot->fragment = m->fragment.data;
+		hot->fragment_len = m->fragment.len;
+		hot->sequence = m->rendered_sequence;
+		hot->bit = UINT64_C(1) << m->index;
+
+		my3status_shm_publish_module(m);
+	}
+
+	state->hot_count = state->order_count;
+
+	my3status_shm_publish_end();
+	my3status_unlock_modules(state, locked);
+}
+
+/*
+ * Marks modules stale that are stuck holding their lock or have missed their
+ * deadline, and clears the mark once they recover. Also retires cached
+ * outputs the module never replaced. Returns true if anything changed, so
+ * the caller knows to render.
+ */
+bool my3status_watchdog(struct my3status_state *state)
+{
+	static int64_t checked_at;
+
+	struct my3status_module		*m;
+	bool				 changed = false;
+
+	int64_t now = my3status_now_ms();
+	if (now - checked_at < MY3STATUS_WATCHDOG_INTERVAL_MS) {
+		return false;
+	}
+
+	checked_at = now;
+
+	bool locked = my3status_lock_modules(state);
+
+	for (unsigned i = 0; i < state->order_count; i += 1) {
+		m = &state->modules[state->order[i]];
+
+		if (pthread_mutex_trylock(&m->output_mutex) == 0) {
+			m->busy_since = 0;
+
+			if (!m->updated && !m->placeholder &&
+			    m->cached_output != NULL &&
+			    now - m->registered_at > CACHED_OUTPUT_MS)
+			{
+				m->cached_output = NULL;
+				m->sequence += 1;
+				changed = true;
+			}
+
+			pthread_mutex_unlock(&m->output_mutex);
+		} else if (m->busy_since == 0) {
+			m->busy_since = now;
+		}
+
+		int64_t heartbeat = atomic_load_explicit(
+			&m->heartbeat, memory_order_relaxed
+		);
+		unsigned deadline = atomic_load_explicit(
+			&m->deadline, memory_order_relaxed
+		);
+
+		bool stale =
+			(m->busy_since != 0 &&
+			 now - m->busy_since > LOCK_DEADLINE_MS) ||
+			(deadline != 0 &&
+			 now - heartbeat > (int64_t) deadline * 1000);
+
+		if (stale == m->stale) {
+			continue;
+		}
+
+		if (stale) {
+			m->stale_count += 1;
+			error(0, 0, "module %s stalled", m->name);
+		} else {
+			error(0, 0, "module %s recovered", m->name);
+		}
+
+		m->stale = stale;
+		changed = true;
+	}
+
+	my3status_unlock_modules(state, locked);
+
+	return changed;
+}
+
+size_t my3status_render_line(
+	struct my3status_state	*state,
+	uint64_t		 mask,
+	struct my3status_buf	*line
+) {
+	struct my3status_hot_module	*hot;
+	bool				 first = true;
+
+	line->len = 0;
+	buf_append(line, "[", 1);
+
+	// only the main thread touches `hot`, so no locking here
+	for (unsigned i = 0; i < state->hot_count; i += 1) {
+		hot = &state->hot[i];
+
+		if ((mask & hot->bit) == 0 || hot->fragment_len == 0) {
+			continue;
+		}
+
+		if (!first) {
+			buf_append(line, ",", 1);
+		}
+
+		buf_append(line, hot->fragment, hot->fragment_len);
+		first = false;
+	}
+
+	buf_append(line, "],\n", 3);
+
+	return line->len;
+}
+
+/*
+ * Called with output_mutex held. Everything after this works on the copy, so
+ * the module gets its lock back as soon as possible.
+ */
+static void copy_output(struct my3status_module *m)
+{
+	// until a module has anything to say, show what it said last run; the
+	// watchdog drops that if the module stays quiet
+	const char *output = m->output;
+	bool visible = m->output_visible;
+	if (!m->updated && m->cached_output != NULL) {
+		output = m->cached_output;
+		visible = true;
+	}
+
+	m->last_output.len = 0;
+	buf_append(&m->last_output, output, strlen(output));
+	m->last_visible = visible;
+}
+
+static void render_fragment(struct my3status_module *m)
+{
+	m->fragment.len = 0;
+
+	if (!m->last_visible || m->last_output.data == NULL) {
+		return;
+	}
+
+	if (m->stale) {
+		buf_printf(
+			&m->fragment,
+			"{\"name\":\"%s\",\"full_text\":\"" STALE_MARKER "%s\","
+			"\"color\":\"" STALE_COLOR "\"}",
+			m->name, m->last_output.data
+		);
+	} else {
+		buf_printf(
+			&m->fragment,
+			"{\"name\":\"%s\",\"full_text\":\"%s\"}",
+			m->name, m->last_output.data
+		);
+	}
+}
+
+static void buf_reserve(struct my3status_buf *b, size_t n)
+{
+	if (b->len + n + 1 <= b->size) {
+		return;
+	}
+
+	size_t size = b->size == 0 ? 256 : b->size;
+	while (size < b->len + n + 1) {
+		size *= 2;
+	}
+
+	char *data = realloc(b->data, size);
+	if (data == NULL) {
+		error(1, errno, "realloc");
+	}
+
+	b->data = data;
+	b->size = size;
+}
+
+static void buf_printf(struct my3status_buf *b, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	int n = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	if (n < 0) {
+		error(1, errno, "vsnprintf");
+	}
+
+	buf_reserve(b, n);
+
+	va_start(ap, format);
+	vsnprintf(b->data + b->len, n + 1, format, ap);
+	va_end(ap);
+
+	b->len += n;
+}
+
+static void buf_append(struct my3status_buf *b, const char *s, size_t n)
+{
+	buf_reserve(b, n);
+
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+	b->data[b->len] = '\0';
+}
@@ -0,0 +1,386 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "my3status.h"
+
+/*
+ * Plays a trace recorded with MY3STATUS_TRACE back through the same
+ * signalling, coalescing and rendering as a live bar, then reports what it
+ * cost. A feeder thread stands in for the modules and replays their outputs
+ * on the original schedule, divided by `speed`; speed 0 replays as fast as
+ * the core keeps up.
+ *
+ * Latency is measured from an update being fed to the first frame that
+ * shows it.
+ */
+struct replay_module {
+	struct my3status_module	*module;
+	char			*output;
+	uint32_t		 output_size;
+	uint32_t		 rendered_sequence;
+	_Atomic int64_t		 fed_at;	/* oldest update not yet shown */
+};
+
+struct replay {
+	struct my3status_state	*state;
+	const char		*data;
+	size_t			 size;
+	double			 speed;
+
+	struct replay_module	 modules[MY3STATUS_MAX_MODULES];
+	unsigned		 module_count;
+	unsigned long		 updates;
+
+	_Atomic bool		 done;
+};
+
+struct latencies {
+	int64_t			*samples;
+	size_t			 count;
+	size_t			 size;
+};
+
+static void load_trace(struct replay *, const char *);
+static void register_modules(struct replay *);
+static void *feed(void *);
+static void sleep_until(int64_t);
+static void collect_latencies(struct replay *, struct latencies *);
+static void add_latency(struct latencies *, int64_t);
+static int compare_latencies(const void *, const void *);
+static void report(struct replay *, struct latencies *, unsigned long,
+		   size_t, int64_t, struct rusage *, struct rusage *);
+static double cpu_ms(struct rusage *, struct rusage *);
+static int64_t percentile(struct latencies *, double);
+
+int my3status_replay_run(
+	struct my3status_state	*state,
+	int			 sfd,
+	int			 argc,
+	char			**argv
+) {
+	if (argc < 1 || argc > 2) {
+		fputs("usage: my3status --replay TRACE [SPEED]\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	struct replay r = { .state = state, .speed = 1.0 };
+
+	if (argc == 2) {
+		char *end;
+		r.speed = strtod(argv[1], &end);
+		if (*end != '\0' || r.speed < 0) {
+			error(1, 0, "invalid speed: %s", argv[1]);
+		}
+	}
+
+	load_trace(&r, argv[0]);
+	register_modules(&r);
+	my3status_freeze_modules(state);
+
+	struct my3status_buf line = { 0 };
+	struct latencies latencies = { 0 };
+	unsigned long frames = 0;
+	size_t bytes = 0;
+
+	struct rusage usage_before, usage_after;
+	getrusage(RUSAGE_SELF, &usage_before);
+	int64_t started = my3status_now_ms();
+
+	pthread_t thread;
+	int e = pthread_create(&thread, NULL, feed, &r);
+	if (e != 0) {
+		error(1, e, "pthread_create");
+	}
+
+	bool render = true;
+
+	while (1) {
+		// checked before rendering, so the last frame has everything
+		bool done = atomic_load(&r.done);
+
+		if (render || done) {
+			my3status_render_fragments(state);
+			bytes += my3status_render_line(
+				state, MY3STATUS_ALL_MODULES, &line
+			);
+
+			collect_latencies(&r, &latencies);
+			frames += 1;
+		}
+
+		if (done) {
+			break;
+		}
+
+		int timeout = my3status_frame_timeout(
+			state, MY3STATUS_WATCHDOG_INTERVAL_MS
+		);
+
+		render = my3status_wait_for_signals(sfd, timeout);
+		render |= my3status_frame_due(state);
+		render |= my3status_watchdog(state);
+	}
+
+	int64_t wall_ms = my3status_now_ms() - started;
+	getrusage(RUSAGE_SELF, &usage_after);
+
+	pthread_join(thread, NULL);
+
+	report(&r, &latencies, frames, bytes, wall_ms,
+	       &usage_before, &usage_after);
+
+	return EXIT_SUCCESS;
+}
+
+static void load_trace(struct replay *r, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		error(1, errno, "can't open trace: %s", path);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		error(1, errno, "fstat");
+	}
+
+	if ((size_t) st.st_size < sizeof(struct my3status_trace_header)) {
+		error(1, 0, "not a trace: %s", path);
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		error(1, errno, "mmap");
+	}
+
+	close(fd);
+
+	const struct my3status_trace_header *header = data;
+	if (header->magic != MY3STATUS_TRACE_MAGIC ||
+	    header->version != MY3STATUS_TRACE_VERSION)
+	{
+		error(1, 0, "not a trace, or from another version: %s", path);
+	}
+
+	r->data = data;
+	r->size = st.st_size;
+}
+
+/*
+ * Registers every module the trace mentions up front, in the order they were
+ * registered in, and sizes their output buffers for the longest output.
+ */
+static void register_modules(struct replay *r)
+{
+	const char *p = r->data + sizeof(struct my3status_trace_header);
+	const char *end = r->data + r->size;
+
+	struct my3status_trace_record record;
+	const char *names[MY3STATUS_MAX_MODULES] = { 0 };
+
+	while (p + sizeof(record) <= end) {
+		memcpy(&record, p, sizeof(record));
+		p += sizeof(record);
+
+		if (p + record.len > end) {
+			break;
+		}
+
+		if (record.module >= MY3STATUS_MAX_MODULES) {
+			error(1, 0, "trace has a bad module index: %u",
+			      record.module);
+		}
+
+		struct replay_module *rm = &r->modules[record.module];
+
+		if (record.type == MY3STATUS_TRACE_MODULE &&
+		    names[record.module] == NULL)
+		{
+			names[record.module] = strndup(p, record.len);
+			if (names[record.module] == NULL) {
+				error(1, errno, "strndup");
+			}
+		} else if (record.type == MY3STATUS_TRACE_OUTPUT) {
+			if (record.len + 1 > rm->output_size) {
+				rm->output_size = record.len + 1;
+			}
+
+			r->updates += 1;
+		}
+
+		p += record.len;
+	}
+
+	for (unsigned i = 0; i < MY3STATUS_MAX_MODULES; i += 1) {
+		if (names[i] == NULL) {
+			continue;
+		}
+
+		struct replay_module *rm = &r->modules[i];
+
+		rm->output = calloc(1, rm->output_size + 1);
+		if (rm->output == NULL) {
+			error(1, errno, "calloc");
+		}
+
+		my3status_set_init_slot(i, i);
+		rm->module = my3status_register_module(
+			r->state, names[i], rm->output, false
+		);
+
+		r->module_count += 1;
+	}
+}
+
+static void *feed(void *arg)
+{
+	struct replay *r = arg;
+
+	const char *p = r->data + sizeof(struct my3status_trace_header);
+	const char *end = r->data + r->size;
+
+	int64_t started = my3status_now_ms();
+	struct my3status_trace_record record;
+
+	while (p + sizeof(record) <= end) {
+		memcpy(&record, p, sizeof(record));
+		p += sizeof(record);
+
+		if (p + record.len > end) {
+			break;
+		}
+
+		struct replay_module *rm = &r->modules[record.module];
+
+		if (record.type != MY3STATUS_TRACE_OUTPUT ||
+		    rm->module == NULL)
+		{
+			p += record.len;
+			continue;
+		}
+
+		if (r->speed > 0) {
+			sleep_until(started + record.time_ns / 1000000 / r->speed);
+		}
+
+		int64_t zero = 0;
+		atomic_compare_exchange_strong(&rm->fed_at, &zero,
+					       my3status_now_ms());
+
+		my3status_output_begin(rm->module);
+		memcpy(rm->output, p, record.len);
+		rm->output[record.len] = '\0';
+		rm->module->output_visible = record.visible;
+		my3status_output_done(rm->module);
+
+		p += record.len;
+	}
+
+	atomic_store(&r->done, true);
+	pthread_kill(r->state->main_thread, SIGUSR1);
+
+	return NULL;
+}
+
+static void sleep_until(int64_t ms)
+{
+	int64_t wait = ms - my3status_now_ms();
+	if (wait <= 0) {
+		return;
+	}
+
+	struct timespec ts = {
+		.tv_sec = wait / 1000, .tv_nsec = (wait % 1000) * 1000000
+	};
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+	}
+}
+
+static void collect_latencies(struct replay *r, struct latencies *l)
+{
+	int64_t now = my3status_now_ms();
+
+	for (unsigned i = 0; i < MY3STATUS_MAX_MODULES; i += 1) {
+		struct replay_module *rm = &r->modules[i];
+
+		if (rm->module == NULL ||
+		    rm->module->rendered_sequence == rm->rendered_sequence)
+		{
+			continue;
+		}
+
+		rm->rendered_sequence = rm->module->rendered_sequence;
+
+		int64_t fed_at = atomic_exchange(&rm->fed_at, 0);
+		if (fed_at != 0) {
+			add_latency(l, now - fed_at);
+		}
+	}
+}
+
+static void add_latency(struct latencies *l, int64_t ms)
+{
+	if (l->count == l->size) {
+		l->size = l->size == 0 ? 1024 : l->size * 2;
+		l->samples = realloc(l->samples, l->size * sizeof(int64_t));
+		if (l->samples == NULL) {
+			error(1, errno, "realloc");
+		}
+	}
+
+	l->samples[l->count++] = ms;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a;
+	int64_t y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(
+	struct replay		*r,
+	struct latencies	*l,
+	unsigned long		 frames,
+	size_t			 bytes,
+	int64_t			 wall_ms,
+	struct rusage		*before,
+	struct rusage		*after
+) {
+	qsort(l->samples, l->count, sizeof(int64_t), compare_latencies);
+
+	printf("modules:  %u\n", r->module_count);
+	printf("updates:  %lu\n", r->updates);
+	printf("frames:   %lu (%zu bytes)\n", frames, bytes);
+	printf("wall:     %" PRId64 " ms\n", wall_ms);
+	printf("cpu:      %.1f ms\n", cpu_ms(before, after));
+	printf("latency:  p50 %" PRId64 " ms, p90 %" PRId64 " ms, "
+	       "p99 %" PRId64 " ms, max %" PRId64 " ms\n",
+	       percentile(l, 0.50), percentile(l, 0.90),
+	       percentile(l, 0.99), percentile(l, 1.0));
+}
+
+static double cpu_ms(struct rusage *before, struct rusage *after)
+{
+	double s = (after->ru_utime.tv_sec - before->ru_utime.tv_sec)
+		 + (after->ru_stime.tv_sec - before->ru_stime.tv_sec);
+	double us = (after->ru_utime.tv_usec - before->ru_utime.tv_usec)
+		  + (after->ru_stime.tv_usec - before->ru_stime.tv_usec);
+
+	return s * 1000 + us / 1000;
+}
+
+static int64_t percentile(struct latencies *l, double p)
+{
+	if (l->count == 0) {
+		return 0;
+	}
+
+	size_t i = p * (l->count - 1);
+	return l->samples[i];
+}
@@ -0,0 +1,261 @@
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "my3status.h"
+
+#define SHM_FILE "my3status.shm"
+// bumped whenever the layout changes
+#define SHM_MAGIC 0x6d793376 // "my3v"
+
+// a publish takes microseconds; a writer that stays in one this long has
+// died halfway through
+#define READ_SPINS 1000
+#define READ_TIMEOUT_MS 100
+
+struct my3status_shm {
+	uint32_t			magic;
+	_Atomic uint32_t		sequence;
+	struct my3status_snapshot	data;
+};
+
+static struct my3status_shm *published;
+
+static char *shm_path();
+static struct my3status_shm *shm_map(int, int);
+
+/*
+ * Writer side, used by the core. Updates are bracketed by two increments of
+ * the sequence number, which is odd while an update is in progress.
+ */
+void my3status_shm_publish_begin()
+{
+	if (published == NULL) {
+		return;
+	}
+
+	atomic_fetch_add_explicit(&published->sequence, 1,
+				  memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	published->data.module_count = 0;
+}
+
+void my3status_shm_publish_module(const struct my3status_module *m)
+{
+	if (published == NULL ||
+	    published->data.module_count == MY3STATUS_SHM_MODULES)
+	{
+		return;
+	}
+
+	struct my3status_snapshot_module *sm =
+		&published->data.modules[published->data.module_count++];
+
+	snprintf(sm->name, MY3STATUS_SHM_NAME_MAX, "%s", m->name);
+	snprintf(sm->output, MY3STATUS_SHM_OUTPUT_MAX, "%s",
+		 m->last_output.data != NULL ? m->last_output.data : "");
+	sm->visible = m->last_visible;
+	sm->stale = m->stale;
+	sm->stale_count = m->stale_count;
+	sm->throttled = atomic_load_explicit(&m->throttled, memory_order_relaxed);
+	sm->reconnects = atomic_load_explicit(&m->reconnects,
+					      memory_order_relaxed);
+	sm->resumed = atomic_load_explicit(&m->resumed, memory_order_relaxed);
+}
+
+void my3status_shm_publish_end()
+{
+	if (published == NULL) {
+		return;
+	}
+
+	atomic_fetch_add_explicit(&published->sequence, 1,
+				  memory_order_release);
+}
+
+int my3status_shm_create()
+{
+	char *path = shm_path();
+	if (path == NULL) {
+		return -1;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		error(0, errno, "%s: open: %s", __func__, path);
+		free(path);
+		return -1;
+	}
+
+	free(path);
+
+	// the sequence number only works with one writer; with a bar per
+	// output, the first instance publishes and the others leave it be.
+	// the lock is held for as long as the file stays open.
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		int e = (errno == EWOULDBLOCK) ? EBUSY : errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(struct my3status_shm)) == -1) {
+		error(0, errno, "%s: ftruncate", __func__);
+		close(fd);
+		return -1;
+	}
+
+	struct my3status_shm *shm = shm_map(fd, PROT_READ | PROT_WRITE);
+	if (shm == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	// readers may still have the file mapped from a previous run
+	atomic_fetch_or_explicit(&shm->sequence, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	shm->magic = SHM_MAGIC;
+	shm->data.module_count = 0;
+
+	atomic_fetch_add_explicit(&shm->sequence, 1, memory_order_release);
+
+	published = shm;
+	return 0;
+}
+
+/*
+ * Reader side, for external programs linking libmy3status.a.
+ */
+struct my3status_shm *my3status_shm_open()
+{
+	char *path = shm_path();
+	if (path == NULL) {
+		return NULL;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 ||
+	    st.st_size < (off_t) sizeof(struct my3status_shm))
+	{
+		close(fd);
+		errno = ENODATA;
+		return NULL;
+	}
+
+	struct my3status_shm *shm = shm_map(fd, PROT_READ);
+	close(fd);
+
+	if (shm != NULL && shm->magic != SHM_MAGIC) {
+		my3status_shm_close(shm);
+		errno = ENODATA;
+		return NULL;
+	}
+
+	return shm;
+}
+
+int my3status_shm_read(
+	const struct my3status_shm	*shm,
+	struct my3status_snapshot	*snapshot,
+	uint32_t			*sequence
+) {
+	uint32_t before, after = 0;
+	int64_t deadline = 0;
+
+	for (unsigned tries = 1; ; tries += 1) {
+		before = atomic_load_explicit(
+			(_Atomic uint32_t *) &shm->sequence,
+			memory_order_acquire
+		);
+
+		if ((before & 1) == 0) {
+			memcpy(snapshot, &shm->data, sizeof(*snapshot));
+
+			atomic_thread_fence(memory_order_acquire);
+			after = atomic_load_explicit(
+				(_Atomic uint32_t *) &shm->sequence,
+				memory_order_relaxed
+			);
+
+			if (before == after) {
+				break;
+			}
+		}
+
+		// spin through a publish, then back off until the deadline
+		if (tries < READ_SPINS) {
+			continue;
+		}
+
+		if (deadline == 0) {
+			deadline = my3status_now_ms() + READ_TIMEOUT_MS;
+		} else if (my3status_now_ms() >= deadline) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		usleep(1000);
+	}
+
+	if (snapshot->module_count > MY3STATUS_SHM_MODULES) {
+		snapshot->module_count = MY3STATUS_SHM_MODULES;
+	}
+
+	if (sequence != NULL) {
+		*sequence = before;
+	}
+
+	return 0;
+}
+
+uint32_t my3status_shm_sequence(const struct my3status_shm *shm)
+{
+	return atomic_load_explicit(
+		(_Atomic uint32_t *) &shm->sequence,
+		memory_order_acquire
+	);
+}
+
+void my3status_shm_close(struct my3status_shm *shm)
+{
+	munmap(shm, sizeof(struct my3status_shm));
+}
+
+static char *shm_path()
+{
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	char *path = malloc(strlen(runtime_dir) + 1 + strlen(SHM_FILE) + 1);
+	if (path == NULL) {
+		return NULL;
+	}
+
+	sprintf(path, "%s/" SHM_FILE, runtime_dir);
+	return path;
+}
+
+static struct my3status_shm *shm_map(int fd, int prot)
+{
+	void *p = mmap(NULL, sizeof(struct my3status_shm), prot, MAP_SHARED,
+		       fd, 0);
+
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+
+	return p;
+}
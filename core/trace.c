@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "my3status.h"
+
+/*
+ * Recording side of traces; see replay.c for the other half. With
+ * MY3STATUS_TRACE set, every module registration and every
+ * my3status_output_done() is appended to that file. Records are written with
+ * one writev() each to an O_APPEND file, so module threads don't need to
+ * coordinate, other than not closing the file while another one writes.
+ */
+static _Atomic int trace_fd = -1;
+static pthread_rwlock_t trace_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int64_t trace_start;
+
+static int64_t now_ns();
+static void trace_write(uint8_t, const struct my3status_module *,
+			const char *);
+
+void my3status_trace_start()
+{
+	const char *path = getenv("MY3STATUS_TRACE");
+	if (path == NULL || path[0] == '\0') {
+		return;
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		      0600);
+	if (fd == -1) {
+		error(0, errno, "not tracing to %s", path);
+		return;
+	}
+
+	struct my3status_trace_header header = {
+		.magic = MY3STATUS_TRACE_MAGIC,
+		.version = MY3STATUS_TRACE_VERSION,
+	};
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		error(0, errno, "not tracing to %s", path);
+		close(fd);
+		return;
+	}
+
+	trace_start = now_ns();
+	atomic_store(&trace_fd, fd);
+}
+
+/*
+ * Called with output_mutex held.
+ */
+void my3status_trace_module(const struct my3status_module *m)
+{
+	if (atomic_load_explicit(&trace_fd, memory_order_relaxed) != -1) {
+		trace_write(MY3STATUS_TRACE_MODULE, m, m->name);
+	}
+}
+
+/*
+ * Called with output_mutex held.
+ */
+void my3status_trace_output(const struct my3status_module *m)
+{
+	if (atomic_load_explicit(&trace_fd, memory_order_relaxed) != -1) {
+		trace_write(MY3STATUS_TRACE_OUTPUT, m, m->output);
+	}
+}
+
+static void trace_write(
+	uint8_t				 type,
+	const struct my3status_module	*m,
+	const char			*data
+) {
+	struct my3status_trace_record record = {
+		.time_ns = now_ns() - trace_start,
+		.type = type,
+		.visible = m->output_visible,
+		.module = m->index,
+		.len = strlen(data),
+	};
+
+	struct iovec iov[] = {
+		{ .iov_base = &record, .iov_len = sizeof(record) },
+		{ .iov_base = (void *) data, .iov_len = record.len },
+	};
+
+	ssize_t expected = sizeof(record) + record.len;
+
+	// writers share the lock; only closing the file needs it to itself
+	pthread_rwlock_rdlock(&trace_lock);
+
+	int fd = atomic_load_explicit(&trace_fd, memory_order_relaxed);
+	bool failed = (fd != -1 && writev(fd, iov, 2) != expected);
+	int e = errno;
+
+	pthread_rwlock_unlock(&trace_lock);
+
+	if (!failed) {
+		return;
+	}
+
+	// a truncated trace is still useful up to here. of the threads that
+	// fail, the first one to get here closes the file.
+	pthread_rwlock_wrlock(&trace_lock);
+
+	if (atomic_exchange(&trace_fd, -1) == fd) {
+		error(0, e, "trace: writev, no longer tracing");
+		close(fd);
+	}
+
+	pthread_rwlock_unlock(&trace_lock);
+}
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		error(1, errno, "clock_gettime");
+	}
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "my3status.h"
+
+/*
+ * Time zones read straight from the tz database (TZif files, RFC 8536), for
+ * modules that show zones other than the local one. The libc only knows the
+ * zone in TZ, and changing TZ isn't safe once there are other threads.
+ *
+ * Times after the last transition in the file follow the POSIX TZ rule in
+ * its footer. Names that aren't files are tried as POSIX TZ rules
+ * themselves, e.g. "EST5EDT,M3.2.0,M11.1.0". Leap seconds are ignored.
+ */
+#define TZ_DIR "/usr/share/zoneinfo"
+#define TZIF_MAX (1 << 20)
+#define TZIF_HEADER_SIZE 44
+
+// rules that name a DST zone but no dates get the US dates, like libcs
+// without a posixrules file give them
+#define DEFAULT_DATES ",M3.2.0,M11.1.0"
+
+struct rule_date {
+	char	kind;		// 'M'onth.week.day, 'J'ulian, or 'n' (0-based)
+	int	month;
+	int	week;
+	int	day;
+	long	time;		// after local midnight, seconds
+};
+
+struct rule {
+	long			std_offset;	// east of UTC, seconds
+	long			dst_offset;
+	bool			has_dst;
+	struct rule_date	start;
+	struct rule_date	end;
+};
+
+struct my3status_tz {
+	int64_t		*times;
+	long		*offsets;	// in effect from times[i] on
+	uint32_t	 count;
+	long		 initial;	// before the first transition
+
+	bool		 has_rule;
+	struct rule	 rule;
+};
+
+static bool load_file(struct my3status_tz *, const char *);
+static bool parse_tzif(struct my3status_tz *, const unsigned char *, size_t);
+static bool parse_block(struct my3status_tz *, const unsigned char *, size_t,
+			const uint32_t *, int);
+static size_t block_size(const uint32_t *, int);
+static int64_t read_be(const unsigned char *, int);
+static bool parse_rule(const char *, struct rule *);
+static const char *parse_name(const char *);
+static bool parse_hms(const char **, long *);
+static bool parse_date(const char **, struct rule_date *);
+static long rule_offset(const struct rule *, time_t, time_t *);
+static int64_t rule_time(const struct rule_date *, int);
+static int64_t days_from_civil(int, int, int);
+static int days_in_month(int, int);
+static bool is_leap(int);
+
+/*
+ * Takes a name as TZ would: a path, a name under $TZDIR or the system's zone
+ * directory, or a POSIX TZ rule. Returns NULL if it's none of those.
+ */
+struct my3status_tz *my3status_tz_load(const char *name)
+{
+	if (name[0] == ':') {
+		name += 1;
+	}
+
+	struct my3status_tz *tz = calloc(1, sizeof(*tz));
+	if (tz == NULL) {
+		error(1, errno, "calloc");
+	}
+
+	char *path;
+	const char *dir = getenv("TZDIR");
+	if (dir == NULL || dir[0] == '\0') {
+		dir = TZ_DIR;
+	}
+
+	int r = (name[0] == '/') ? asprintf(&path, "%s", name)
+				 : asprintf(&path, "%s/%s", dir, name);
+	if (r == -1) {
+		error(1, errno, "asprintf");
+	}
+
+	bool ok = load_file(tz, path);
+	free(path);
+
+	if (!ok && parse_rule(name, &tz->rule)) {
+		tz->has_rule = true;
+		tz->initial = tz->rule.std_offset;
+		ok = true;
+	}
+
+	if (!ok) {
+		my3status_tz_free(tz);
+		return NULL;
+	}
+
+	return tz;
+}
+
+void my3status_tz_free(struct my3status_tz *tz)
+{
+	if (tz == NULL) {
+		return;
+	}
+
+	free(tz->times);
+	free(tz->offsets);
+	free(tz);
+}
+
+/*
+ * Returns the zone's UTC offset at `t`, and lowers `until` to when that
+ * next changes if that's sooner.
+ */
+long my3status_tz_offset(const struct my3status_tz *tz, time_t t,
+			 time_t *until)
+{
+	// the first transition after t
+	uint32_t lo = 0, hi = tz->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (tz->times[mid] <= t) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	long offset = (lo == 0) ? tz->initial : tz->offsets[lo - 1];
+
+	if (lo < tz->count) {
+		if (tz->times[lo] < *until) {
+			*until = tz->times[lo];
+		}
+
+		return offset;
+	}
+
+	return tz->has_rule ? rule_offset(&tz->rule, t, until) : offset;
+}
+
+static bool load_file(struct my3status_tz *tz, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_size > TZIF_MAX)
+	{
+		close(fd);
+		return false;
+	}
+
+	unsigned char *data = malloc(st.st_size);
+	if (data == NULL) {
+		error(1, errno, "malloc");
+	}
+
+	ssize_t n = read(fd, data, st.st_size);
+	close(fd);
+
+	bool ok = (n == st.st_size && parse_tzif(tz, data, n));
+	if (!ok) {
+		error(0, 0, "not a usable TZif file: %s", path);
+	}
+
+	free(data);
+	return ok;
+}
+
+static bool parse_tzif(struct my3status_tz *tz, const unsigned char *p,
+		       size_t len)
+{
+	uint32_t counts[6];
+
+	if (len < TZIF_HEADER_SIZE || memcmp(p, "TZif", 4) != 0) {
+		return false;
+	}
+
+	// isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt
+	for (int i = 0; i < 6; i += 1) {
+		counts[i] = read_be(p + 20 + 4 * i, 4);
+	}
+
+	size_t v1_size = block_size(counts, 4);
+	if (p[4] < '2') {
+		return len - TZIF_HEADER_SIZE >= v1_size &&
+		       parse_block(tz, p + TZIF_HEADER_SIZE, v1_size, counts, 4);
+	}
+
+	// version 2 and up repeat everything with 64 bit times, then the rule
+	size_t skip = TZIF_HEADER_SIZE + v1_size;
+	if (len - TZIF_HEADER_SIZE < v1_size ||
+	    len - skip < TZIF_HEADER_SIZE ||
+	    memcmp(p + skip, "TZif", 4) != 0)
+	{
+		return false;
+	}
+
+	p += skip;
+	len -= skip;
+
+	for (int i = 0; i < 6; i += 1) {
+		counts[i] = read_be(p + 20 + 4 * i, 4);
+	}
+
+	size_t v2_size = block_size(counts, 8);
+	if (len - TZIF_HEADER_SIZE < v2_size ||
+	    !parse_block(tz, p + TZIF_HEADER_SIZE, v2_size, counts, 8))
+	{
+		return false;
+	}
+
+	const char *footer = (const char *) p + TZIF_HEADER_SIZE + v2_size;
+	size_t footer_len = len - TZIF_HEADER_SIZE - v2_size;
+	if (footer_len < 2 || footer[0] != '\n') {
+		return true;
+	}
+
+	const char *nl = memchr(footer + 1, '\n', footer_len - 1);
+	if (nl == NULL) {
+		return true;
+	}
+
+	char *rule = strndup(footer + 1, nl - footer - 1);
+	if (rule == NULL) {
+		error(1, errno, "strndup");
+	}
+
+	// an empty or odd rule leaves the last transition in effect
+	tz->has_rule = parse_rule(rule, &tz->rule);
+	free(rule);
+
+	return true;
+}
+
+static bool parse_block(
+	struct my3status_tz	*tz,
+	const unsigned char	*p,
+	size_t			 len,
+	const uint32_t		*counts,
+	int			 time_size
+) {
+	uint32_t timecnt = counts[3];
+	uint32_t typecnt = counts[4];
+
+	if (typecnt == 0 || len < block_size(counts, time_size)) {
+		return false;
+	}
+
+	const unsigned char *times = p;
+	const unsigned char *indices = times + (size_t) timecnt * time_size;
+	const unsigned char *types = indices + timecnt;
+
+	tz->times = calloc(timecnt + 1, sizeof(int64_t));
+	tz->offsets = calloc(timecnt + 1, sizeof(long));
+	if (tz->times == NULL || tz->offsets == NULL) {
+		error(1, errno, "calloc");
+	}
+
+	tz->initial = (int32_t) read_be(types, 4);
+	tz->count = 0;
+
+	for (uint32_t i = 0; i < timecnt; i += 1) {
+		if (indices[i] >= typecnt) {
+			return false;
+		}
+
+		// only the offset matters here, so abbreviation changes and
+		// the like aren't transitions
+		long offset = (int32_t) read_be(types + 6 * indices[i], 4);
+		long previous = (tz->count == 0) ? tz->initial
+						 : tz->offsets[tz->count - 1];
+		if (offset == previous) {
+			continue;
+		}
+
+		tz->times[tz->count] = read_be(
+			times + (size_t) i * time_size, time_size
+		);
+		tz->offsets[tz->count] = offset;
+		tz->count += 1;
+	}
+
+	return true;
+}
+
+static size_t block_size(const uint32_t *counts, int time_size)
+{
+	return (size_t) counts[3] * time_size	// transition times
+	     + counts[3]			// their types
+	     + (size_t) counts[4] * 6		// types
+	     + counts[5]			// abbreviations
+	     + (size_t) counts[2] * (time_size + 4) // leap seconds
+	     + counts[1]			// standard/wall indicators
+	     + counts[0];			// UT/local indicators
+}
+
+static int64_t read_be(const unsigned char *p, int size)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < size; i += 1) {
+		v = (v << 8) | p[i];
+	}
+
+	return size == 4 ? (int32_t) v : (int64_t) v;
+}
+
+/*
+ * std offset [dst [offset] [,start[/time],end[/time]]], with offsets west
+ * of UTC like POSIX has them.
+ */
+static bool parse_rule(const char *s, struct rule *r)
+{
+	long v;
+
+	s = parse_name(s);
+	if (s == NULL || !parse_hms(&s, &v)) {
+		return false;
+	}
+
+	r->std_offset = -v;
+	r->has_dst = false;
+
+	if (*s == '\0') {
+		return true;
+	}
+
+	s = parse_name(s);
+	if (s == NULL) {
+		return false;
+	}
+
+	r->dst_offset = r->std_offset + 3600;
+	if (*s != ',' && *s != '\0') {
+		if (!parse_hms(&s, &v)) {
+			return false;
+		}
+
+		r->dst_offset = -v;
+	}
+
+	if (*s == '\0') {
+		s = DEFAULT_DATES;
+	}
+
+	if (*s++ != ',' || !parse_date(&s, &r->start) ||
+	    *s++ != ',' || !parse_date(&s, &r->end) || *s != '\0')
+	{
+		return false;
+	}
+
+	r->has_dst = true;
+	return true;
+}
+
+static const char *parse_name(const char *s)
+{
+	if (*s == '<') {
+		const char *end = strchr(s, '>');
+		return end != NULL ? end + 1 : NULL;
+	}
+
+	const char *p = s;
+	while (isalpha((unsigned char) *p)) {
+		p += 1;
+	}
+
+	return p - s >= 3 ? p : NULL;
+}
+
+/*
+ * [+-]hh[:mm[:ss]], in seconds.
+ */
+static bool parse_hms(const char **s, long *out)
+{
+	const char *p = *s;
+	long sign = 1;
+
+	if (*p == '+' || *p == '-') {
+		sign = (*p == '-') ? -1 : 1;
+		p += 1;
+	}
+
+	if (!isdigit((unsigned char) *p)) {
+		return false;
+	}
+
+	char *end;
+	long v = strtol(p, &end, 10) * 3600;
+
+	if (*end == ':') {
+		v += strtol(end + 1, &end, 10) * 60;
+
+		if (*end == ':') {
+			v += strtol(end + 1, &end, 10);
+		}
+	}
+
+	*out = sign * v;
+	*s = end;
+	return true;
+}
+
+static bool parse_date(const char **s, struct rule_date *d)
+{
+	const char *p = *s;
+	char *end;
+
+	*d = (struct rule_date) { .time = 2 * 3600 };
+
+	if (*p == 'M') {
+		d->kind = 'M';
+		d->month = strtol(p + 1, &end, 10);
+		if (*end != '.') {
+			return false;
+		}
+
+		d->week = strtol(end + 1, &end, 10);
+		if (*end != '.') {
+			return false;
+		}
+
+		d->day = strtol(end + 1, &end, 10);
+
+		if (d->month < 1 || d->month > 12 || d->week < 1 ||
+		    d->week > 5 || d->day < 0 || d->day > 6)
+		{
+			return false;
+		}
+	} else if (*p == 'J' || isdigit((unsigned char) *p)) {
+		d->kind = (*p == 'J') ? 'J' : 'n';
+		d->day = strtol(*p == 'J' ? p + 1 : p, &end, 10);
+
+		if (d->day < (d->kind == 'J') || d->day > 365) {
+			return false;
+		}
+	} else {
+		return false;
+	}
+
+	if (*end == '/') {
+		const char *t = end + 1;
+		if (!parse_hms(&t, &d->time)) {
+			return false;
+		}
+
+		end = (char *) t;
+	}
+
+	*s = end;
+	return true;
+}
+
+/*
+ * Looks at the transitions of the years around `t`, which are enough to
+ * find the one before it and the one after.
+ */
+static long rule_offset(const struct rule *r, time_t t, time_t *until)
+{
+	if (!r->has_dst) {
+		return r->std_offset;
+	}
+
+	// an average Gregorian year; off by one near New Year doesn't matter
+	int year = 1970 + (t + r->std_offset) / 31556952;
+
+	int64_t latest = INT64_MIN;
+	long offset = r->std_offset;
+
+	for (int y = year - 1; y <= year + 1; y += 1) {
+		// start is given in standard time, end in daylight time
+		struct {
+			int64_t	when;
+			long	offset;
+		} changes[2] = {
+			{ rule_time(&r->start, y) - r->std_offset, r->dst_offset },
+			{ rule_time(&r->end, y) - r->dst_offset, r->std_offset },
+		};
+
+		for (int i = 0; i < 2; i += 1) {
+			int64_t when = changes[i].when;
+
+			if (when <= t && when > latest) {
+				latest = when;
+				offset = changes[i].offset;
+			} else if (when > t && when < *until) {
+				*until = when;
+			}
+		}
+	}
+
+	return offset;
+}
+
+/*
+ * Local time of a rule date in `year`, in seconds since the epoch.
+ */
+static int64_t rule_time(const struct rule_date *d, int year)
+{
+	int64_t jan1 = days_from_civil(year, 1, 1);
+	int64_t day;
+
+	if (d->kind == 'J') {
+		// 1 to 365, never counting February 29
+		day = jan1 + d->day - 1 + (is_leap(year) && d->day >= 60);
+	} else if (d->kind == 'n') {
+		day = jan1 + d->day;
+	} else {
+		int64_t first = days_from_civil(year, d->month, 1);
+		int weekday = ((first + 4) % 7 + 7) % 7; // 1970-01-01 was a Thursday
+
+		day = first + (d->day - weekday + 7) % 7 + 7 * (d->week - 1);
+
+		// week 5 means the last one
+		while (day >= first + days_in_month(year, d->month)) {
+			day -= 7;
+		}
+	}
+
+	return day * 86400 + d->time;
+}
+
+/*
+ * Days since 1970-01-01 in the proleptic Gregorian calendar.
+ */
+static int64_t days_from_civil(int y, int m, int d)
+{
+	y -= (m <= 2);
+
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	int64_t yoe = y - era * 400;
+	int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+static int days_in_month(int year, int month)
+{
+	static const int days[] = {
+		31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+	};
+
+	return days[month - 1] + (month == 2 && is_leap(year));
+}
+
+static bool is_leap(int year)
+{
+	return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
@@ -23,4 +23,8 @@ $(BUILD_DIR)/imap.so: $(CARGO_IMAP_TARGET)
 
 $(CARGO_IMAP_TARGET): imap/build.rs imap/Cargo.toml imap/Cargo.lock
 $(CARGO_IMAP_TARGET): $(wildcard imap/src/*.rs)
-	cd imap; cargo build $(CARGO_BUILD_ARG)
\ No newline at end of file
+	cd imap; cargo build $(CARGO_BUILD_ARG)
+# the tests link against the archive like the module does
+.PHONY: check
+check:: $(BUILD_DIR)/libmy3status.a
+	cd imap; cargo test $(CARGO_BUILD_ARG)
@@ -1,9 +1,20 @@
 extern crate imap;
+extern crate imap_proto;
+extern crate openssl;
 extern crate serde;
 extern crate serde_derive;
 extern crate my3status;
 
-use std::sync::mpsc;
+use std::collections::BTreeSet;
+use std::hash::{BuildHasher, Hasher};
+use std::io::{Read, Write};
+use std::net::TcpStream;
+use std::sync::{mpsc, Arc, Mutex};
+use std::time::Duration;
+use imap::extensions::idle::SetReadTimeout;
+use imap::types::{Flag, Seq, UnsolicitedResponse};
+use imap_proto::types::AttributeValue;
+use openssl::ssl::{SslConnector, SslMethod, SslSession, SslSessionCacheMode, SslStream};
 use serde_derive::Deserialize;
 
 #[derive(Deserialize)]
@@ -39,11 +50,14 @@ pub extern fn my3status_module_init(state_ptr: my3status::StatePtr) {
     let config = load_config().expect("failed to load imap config");
     let (tx, rx) = mpsc::channel();
 
+    let counters = module.clone();
     std::thread::spawn(move || output_thread(rx, module, &mut output));
 
     for (pos, account) in config.accounts.into_iter().enumerate() {
         let tx = tx.clone();
-        std::thread::spawn(move || monitor_thread(pos, account, tx));
+        let tls = Tls::new().expect("failed to set up tls");
+        let conn = Connector::new(tls, Some(counters.clone()));
+        std::thread::spawn(move || monitor_thread(pos, account, conn, tx));
     }
 }
 
@@ -92,37 +106,609 @@ fn aggregate_account_statuses(a: &AccountStatusMap) -> Option<String> {
     })
 }
 
-fn monitor_thread(id: usize, account: Account, tx: Sender) {
+const BACKOFF_MIN: Duration = Duration::from_secs(1);
+const BACKOFF_MAX: Duration = Duration::from_secs(300);
+
+// how often to poll with NOOP on servers that can't IDLE
+const NOOP_INTERVAL: Duration = Duration::from_secs(60);
+
+/// How a Connector reaches the server: TLS for real accounts, plain TCP to
+/// the scripted server in the tests.
+trait Transport {
+    type Stream: Read + Write + SetReadTimeout;
+
+    /// Returns the stream and whether it resumed an earlier TLS session.
+    fn open(&mut self, account: &Account) -> Result<(Self::Stream, bool), Box<dyn std::error::Error>>;
+}
+
+struct Tls {
+    connector: SslConnector,
+    session: Arc<Mutex<Option<SslSession>>>,
+}
+
+impl Tls {
+    fn new() -> Result<Self, openssl::error::ErrorStack> {
+        let session = Arc::new(Mutex::new(None));
+
+        // TLS 1.3 hands out tickets after the handshake, so grab them as
+        // they arrive rather than asking for the session once connected
+        let slot = session.clone();
+        let mut builder = SslConnector::builder(SslMethod::tls())?;
+        builder.set_session_cache_mode(SslSessionCacheMode::CLIENT);
+        builder.set_new_session_callback(move |_, session| {
+            *slot.lock().unwrap() = Some(session);
+        });
+
+        Ok(Self { connector: builder.build(), session })
+    }
+}
+
+impl Transport for Tls {
+    type Stream = SslStream<TcpStream>;
+
+    fn open(&mut self, account: &Account) -> Result<(Self::Stream, bool), Box<dyn std::error::Error>> {
+        let tcp = TcpStream::connect((account.host.as_str(), account.port))?;
+
+        let mut config = self.connector.configure()?;
+        if let Some(session) = self.session.lock().unwrap().as_ref() {
+            // safe: the session was issued by this same connector
+            unsafe { config.set_session(session)? };
+        }
+
+        let stream = config.connect(&account.host, tcp)?;
+        let resumed = stream.ssl().session_reused();
+
+        Ok((stream, resumed))
+    }
+}
+
+/// Per-account state that outlives a single connection.
+struct Connector<T: Transport> {
+    transport: T,
+    can_idle: Option<bool>,
+    noop_interval: Duration,
+
+    // consecutive failed attempts, reset once a session is established
+    failures: u32,
+
+    // also counted in the core's shared memory snapshot, summed over
+    // every account; there is no core to count in during the tests
+    reconnects: u64,
+    resumed: u64,
+    module: Option<my3status::Module>,
+}
+
+impl<T: Transport> Connector<T> {
+    fn new(transport: T, module: Option<my3status::Module>) -> Self {
+        Self {
+            transport,
+            can_idle: None,
+            noop_interval: NOOP_INTERVAL,
+            failures: 0,
+            reconnects: 0,
+            resumed: 0,
+            module,
+        }
+    }
+
+    fn connect(&mut self, account: &Account) -> Result<imap::Client<T::Stream>, Box<dyn std::error::Error>> {
+        let (stream, resumed) = self.transport.open(account)?;
+        if resumed {
+            self.resumed += 1;
+            if let Some(m) = &self.module { m.count_resumed() }
+        }
+
+        let mut client = imap::Client::new(stream);
+        client.read_greeting()?;
+
+        Ok(client)
+    }
+
+    fn count_reconnect(&mut self) {
+        self.reconnects += 1;
+        if let Some(m) = &self.module { m.count_reconnect() }
+    }
+
+    /// Exponential backoff with jitter, so that accounts on the same server
+    /// don't all come knocking at once when it returns.
+    fn backoff(&mut self) -> Duration {
+        let max = BACKOFF_MIN
+            .checked_mul(1 << self.failures.min(16))
+            .map_or(BACKOFF_MAX, |d| d.min(BACKOFF_MAX));
+
+        self.failures += 1;
+
+        let jitter = std::collections::hash_map::RandomState::new()
+            .build_hasher()
+            .finish();
+
+        max / 2 + Duration::from_millis(jitter % (max.as_millis() as u64 / 2 + 1))
+    }
+}
+
+fn monitor_thread<T: Transport>(id: usize, account: Account, mut conn: Connector<T>, tx: Sender) {
     loop {
-        let e = monitor_unseen_messages(id, &account, &tx).err().unwrap();
+        let e = monitor_unseen_messages(id, &account, &mut conn, &tx).err().unwrap();
 
         tx.send((id, Status::Error)).unwrap();
 
+        let delay = conn.backoff();
+        conn.count_reconnect();
+
         eprintln!("imap error: {}", e);
-        eprintln!("reconnecting in 3 seconds...");
+        eprintln!("{}: reconnect #{} in {:.1?} ({} tls sessions resumed)...",
+                  account.host, conn.reconnects, delay, conn.resumed);
 
-        std::thread::sleep(std::time::Duration::from_secs(3));
+        std::thread::sleep(delay);
     }
 }
 
-fn monitor_unseen_messages(id: usize, account: &Account, tx: &Sender) -> Result<(), imap::Error> {
-    let client = imap::ClientBuilder::new(&account.host, account.port)
-        .native_tls()?;
+fn monitor_unseen_messages<T: Transport>(id: usize, account: &Account, conn: &mut Connector<T>, tx: &Sender) -> Result<(), Box<dyn std::error::Error>> {
+    let client = conn.connect(account)?;
 
     let mut session = client
         .login(&account.username, &account.password)
         .map_err(|e| e.0)?;
 
-    session.select("INBOX")?;
+    let can_idle = match conn.can_idle {
+        Some(c) => c,
+        None => *conn.can_idle.insert(session.capabilities()?.has_str("IDLE")),
+    };
 
-    loop {
-        let results = session.search("UNSEEN")?;
+    let mailbox = session.select("INBOX")?;
+    let mut tracker = UnseenTracker::new(mailbox.exists, session.search("UNSEEN")?);
+
+    conn.failures = 0;
 
-        let i = results.len();
+    let mut pending = Vec::new();
+
+    loop {
+        let i = tracker.count();
         tx.send((id, Status::Normal(i))).unwrap();
         eprintln!("unseen messages: {}, idling...", i);
 
-        let idle_handle = session.idle()?;
-        idle_handle.wait_keepalive_while(|_| { false })?;
+        if can_idle {
+            // Stop idling on the first untagged response; anything that
+            // arrives after it is picked up from the unsolicited channel.
+            let idle_handle = session.idle()?;
+            idle_handle.wait_keepalive_while(|r| { pending.push(r); false })?;
+        } else {
+            std::thread::sleep(conn.noop_interval);
+            session.noop()?;
+        }
+
+        pending.extend(session.unsolicited_responses.try_iter());
+
+        while !pending.is_empty() {
+            for r in pending.drain(..) {
+                tracker.apply(&r);
+            }
+
+            match tracker.take_action() {
+                Action::None => {},
+                Action::FetchFlags(first, last) => {
+                    let fetches = session.fetch(format!("{}:{}", first, last), "FLAGS")?;
+                    for f in fetches.iter() {
+                        tracker.set_seen(f.message, f.flags().contains(&Flag::Seen));
+                    }
+                },
+                Action::Resync => {
+                    let mailbox = session.select("INBOX")?;
+                    tracker = UnseenTracker::new(mailbox.exists, session.search("UNSEEN")?);
+                },
+            }
+
+            // responses that arrived while the above command was running
+            pending.extend(session.unsolicited_responses.try_iter());
+        }
+    }
+}
+
+enum Action {
+    None,
+    FetchFlags(u32, u32),
+    Resync,
+}
+
+/// Sequence numbers of the unseen messages in the selected mailbox, kept
+/// current from EXISTS, EXPUNGE and FETCH responses so that a wakeup only
+/// costs a FLAGS fetch of the new messages instead of a SEARCH UNSEEN.
+struct UnseenTracker {
+    exists: u32,
+    unseen: BTreeSet<Seq>,
+    fetch_from: Option<u32>,
+    resync: bool,
+}
+
+impl UnseenTracker {
+    fn new<I: IntoIterator<Item = Seq>>(exists: u32, unseen: I) -> Self {
+        Self {
+            exists,
+            unseen: unseen.into_iter().collect(),
+            fetch_from: None,
+            resync: false,
+        }
+    }
+
+    fn count(&self) -> usize {
+        self.unseen.len()
+    }
+
+    fn apply(&mut self, r: &UnsolicitedResponse) {
+        match r {
+            UnsolicitedResponse::Exists(n) if *n > self.exists => {
+                self.fetch_from.get_or_insert(self.exists + 1);
+                self.exists = *n;
+            },
+            UnsolicitedResponse::Exists(n) if *n < self.exists => {
+                self.resync = true;
+            },
+            UnsolicitedResponse::Expunge(seq) => self.expunge(*seq),
+            UnsolicitedResponse::Fetch { id, attributes } => {
+                for a in attributes {
+                    if let AttributeValue::Flags(flags) = a {
+                        let seen = flags.iter().any(|f| f == "\\Seen");
+                        self.set_seen(*id, seen);
+                    }
+                }
+            },
+            // only sent with QRESYNC, which we never enable; don't guess
+            UnsolicitedResponse::Vanished { .. } => self.resync = true,
+            _ => {},
+        }
+    }
+
+    fn expunge(&mut self, seq: Seq) {
+        if seq > self.exists {
+            self.resync = true;
+            return;
+        }
+
+        self.exists -= 1;
+        self.unseen = self.unseen.iter()
+            .filter(|&&s| s != seq)
+            .map(|&s| if s > seq { s - 1 } else { s })
+            .collect();
+
+        // a pending fetch range shifts down along with everything else
+        if let Some(from) = self.fetch_from {
+            if from > seq { self.fetch_from = Some(from - 1) }
+        }
+    }
+
+    fn set_seen(&mut self, seq: Seq, seen: bool) {
+        if seen {
+            self.unseen.remove(&seq);
+        } else if seq <= self.exists {
+            self.unseen.insert(seq);
+        }
+    }
+
+    fn take_action(&mut self) -> Action {
+        let fetch_from = self.fetch_from.take();
+
+        if self.resync {
+            self.resync = false;
+            return Action::Resync;
+        }
+
+        match fetch_from {
+            Some(from) if from <= self.exists => Action::FetchFlags(from, self.exists),
+            _ => Action::None,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::borrow::Cow;
+    use std::io::{BufRead, BufReader};
+    use std::net::TcpListener;
+
+    fn tracker(exists: u32, unseen: &[Seq]) -> UnseenTracker {
+        UnseenTracker::new(exists, unseen.iter().copied())
+    }
+
+    fn unseen(t: &UnseenTracker) -> Vec<Seq> {
+        t.unseen.iter().copied().collect()
+    }
+
+    fn flags(id: Seq, flags: &[&'static str]) -> UnsolicitedResponse {
+        let flags = flags.iter().map(|&f| Cow::Borrowed(f)).collect();
+        UnsolicitedResponse::Fetch { id, attributes: vec![AttributeValue::Flags(flags)] }
     }
-}
\ No newline at end of file
+
+    // the range to fetch, if any; a resync here is a test failure
+    fn fetch(t: &mut UnseenTracker) -> Option<(u32, u32)> {
+        match t.take_action() {
+            Action::None => None,
+            Action::FetchFlags(first, last) => Some((first, last)),
+            Action::Resync => panic!("unexpected resync"),
+        }
+    }
+
+    fn resyncs(t: &mut UnseenTracker) -> bool {
+        matches!(t.take_action(), Action::Resync)
+    }
+
+    #[test]
+    fn exists_growth_fetches_new_messages() {
+        let mut t = tracker(3, &[2]);
+        t.apply(&UnsolicitedResponse::Exists(5));
+        t.apply(&UnsolicitedResponse::Exists(7));
+
+        assert_eq!(fetch(&mut t), Some((4, 7)));
+        assert_eq!(fetch(&mut t), None);
+        assert_eq!(unseen(&t), [2]);
+    }
+
+    #[test]
+    fn exists_unchanged_does_nothing() {
+        let mut t = tracker(3, &[2]);
+        t.apply(&UnsolicitedResponse::Exists(3));
+
+        assert_eq!(fetch(&mut t), None);
+    }
+
+    #[test]
+    fn exists_shrink_resyncs() {
+        let mut t = tracker(3, &[2]);
+        t.apply(&UnsolicitedResponse::Exists(5));
+        t.apply(&UnsolicitedResponse::Exists(4));
+
+        assert!(resyncs(&mut t));
+
+        // the fetch range went with the resync
+        assert_eq!(fetch(&mut t), None);
+    }
+
+    #[test]
+    fn expunge_renumbers_unseen() {
+        let mut t = tracker(5, &[1, 3, 5]);
+        t.apply(&UnsolicitedResponse::Expunge(3));
+
+        assert_eq!(unseen(&t), [1, 4]);
+        assert_eq!(t.exists, 4);
+
+        t.apply(&UnsolicitedResponse::Expunge(2));
+        assert_eq!(unseen(&t), [1, 3]);
+        assert_eq!(fetch(&mut t), None);
+    }
+
+    #[test]
+    fn expunge_below_fetch_range_shifts_it() {
+        let mut t = tracker(5, &[2, 4, 5]);
+        t.apply(&UnsolicitedResponse::Exists(7));
+        t.apply(&UnsolicitedResponse::Expunge(3));
+
+        assert_eq!(unseen(&t), [2, 3, 4]);
+        assert_eq!(fetch(&mut t), Some((5, 6)));
+    }
+
+    #[test]
+    fn expunge_inside_fetch_range_shrinks_it() {
+        let mut t = tracker(5, &[]);
+        t.apply(&UnsolicitedResponse::Exists(8));
+
+        // the first new message
+        t.apply(&UnsolicitedResponse::Expunge(6));
+        assert_eq!(t.exists, 7);
+
+        // the last one
+        t.apply(&UnsolicitedResponse::Expunge(7));
+        assert_eq!(fetch(&mut t), Some((6, 6)));
+    }
+
+    #[test]
+    fn expunge_of_every_new_message_cancels_the_fetch() {
+        let mut t = tracker(5, &[1]);
+        t.apply(&UnsolicitedResponse::Exists(6));
+        t.apply(&UnsolicitedResponse::Expunge(6));
+
+        assert_eq!(fetch(&mut t), None);
+        assert_eq!(unseen(&t), [1]);
+    }
+
+    #[test]
+    fn expunge_above_fetch_range_resyncs() {
+        let mut t = tracker(5, &[]);
+        t.apply(&UnsolicitedResponse::Exists(7));
+        t.apply(&UnsolicitedResponse::Expunge(8));
+
+        assert!(resyncs(&mut t));
+    }
+
+    #[test]
+    fn fetch_flags_toggle_seen() {
+        let mut t = tracker(5, &[2]);
+
+        t.apply(&flags(3, &[]));
+        assert_eq!(unseen(&t), [2, 3]);
+
+        t.apply(&flags(2, &["\\Seen"]));
+        assert_eq!(unseen(&t), [3]);
+
+        t.apply(&flags(3, &["\\Flagged", "\\Seen"]));
+        assert_eq!(unseen(&t), [] as [Seq; 0]);
+
+        t.apply(&flags(3, &["\\Flagged"]));
+        assert_eq!(unseen(&t), [3]);
+
+        assert_eq!(fetch(&mut t), None);
+    }
+
+    #[test]
+    fn fetch_flags_beyond_exists_are_ignored() {
+        let mut t = tracker(5, &[]);
+        t.apply(&flags(6, &[]));
+
+        assert_eq!(t.count(), 0);
+    }
+
+    #[test]
+    fn fetched_flags_complete_the_range() {
+        let mut t = tracker(3, &[1]);
+        t.apply(&UnsolicitedResponse::Exists(5));
+        assert_eq!(fetch(&mut t), Some((4, 5)));
+
+        t.set_seen(4, false);
+        t.set_seen(5, true);
+        assert_eq!(unseen(&t), [1, 4]);
+    }
+
+    #[test]
+    fn vanished_resyncs() {
+        let mut t = tracker(5, &[2]);
+        t.apply(&UnsolicitedResponse::Vanished { earlier: false, uids: vec![10..=12] });
+
+        assert!(resyncs(&mut t));
+        assert_eq!(fetch(&mut t), None);
+    }
+
+    struct Plain;
+
+    impl Transport for Plain {
+        type Stream = TcpStream;
+
+        fn open(&mut self, account: &Account) -> Result<(TcpStream, bool), Box<dyn std::error::Error>> {
+            Ok((TcpStream::connect((account.host.as_str(), account.port))?, false))
+        }
+    }
+
+    // one connection's worth of expected commands and the replies to them;
+    // {tag} in a reply is the command's tag, and no reply hangs up
+    type Script = Vec<(&'static str, Option<&'static str>)>;
+
+    // serves each script to the next connection, in order
+    fn serve(scripts: Vec<Script>) -> Account {
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let port = listener.local_addr().unwrap().port();
+
+        std::thread::spawn(move || {
+            for script in scripts {
+                let (stream, _) = listener.accept().unwrap();
+                run_script(stream, script);
+            }
+        });
+
+        Account {
+            host: "127.0.0.1".to_owned(),
+            port,
+            username: "user".to_owned(),
+            password: "secret".to_owned(),
+        }
+    }
+
+    fn run_script(mut stream: TcpStream, script: Script) {
+        let mut reader = BufReader::new(stream.try_clone().unwrap());
+        let mut tag = String::new();
+
+        stream.write_all(b"* OK scripted server ready\r\n").unwrap();
+
+        for (command, reply) in script {
+            let mut line = String::new();
+            reader.read_line(&mut line).unwrap();
+
+            // DONE ends an IDLE and is the only line without a tag
+            let mut words = line.trim_end().split(' ');
+            let got = match words.next().unwrap_or("") {
+                "DONE" => "DONE".to_owned(),
+                t => {
+                    tag = t.to_owned();
+                    words.next().unwrap_or("").to_uppercase()
+                },
+            };
+            assert_eq!(got, command, "unexpected command: {}", line.trim_end());
+
+            match reply {
+                Some(r) => stream.write_all(r.replace("{tag}", &tag).as_bytes()).unwrap(),
+                None => return,
+            }
+        }
+
+        // leave the client waiting on whatever it sends next
+        let _ = std::io::copy(&mut reader, &mut std::io::sink());
+    }
+
+    // runs the real monitor loop, reconnects included, against the server
+    fn monitor(account: Account, noop_interval: Duration) -> Receiver {
+        let (tx, rx) = mpsc::channel();
+        let mut conn = Connector::new(Plain, None);
+        conn.noop_interval = noop_interval;
+
+        std::thread::spawn(move || monitor_thread(0, account, conn, tx));
+        rx
+    }
+
+    // the next unseen count sent to the output thread, or None for an error
+    fn next_status(rx: &Receiver) -> Option<usize> {
+        match rx.recv_timeout(Duration::from_secs(5)).expect("no status from the monitor") {
+            (_, Status::Normal(n)) => Some(n),
+            (_, Status::Error) => None,
+        }
+    }
+
+    #[test]
+    fn monitor_idles_fetches_and_reconnects() {
+        let account = serve(vec![
+            vec![
+                ("LOGIN", Some("{tag} OK logged in\r\n")),
+                ("CAPABILITY", Some("* CAPABILITY IMAP4rev1 IDLE\r\n{tag} OK\r\n")),
+                ("SELECT", Some("* 3 EXISTS\r\n* FLAGS (\\Seen)\r\n{tag} OK [READ-WRITE] selected\r\n")),
+                ("SEARCH", Some("* SEARCH 2\r\n{tag} OK\r\n")),
+                ("IDLE", Some("+ idling\r\n* 5 EXISTS\r\n")),
+                ("DONE", Some("{tag} OK idle done\r\n")),
+                ("FETCH", Some("* 4 FETCH (FLAGS ())\r\n* 5 FETCH (FLAGS (\\Seen))\r\n{tag} OK\r\n")),
+                ("IDLE", None),
+            ],
+            // IDLE support is remembered, so no CAPABILITY this time
+            vec![
+                ("LOGIN", Some("{tag} OK logged in\r\n")),
+                ("SELECT", Some("* 5 EXISTS\r\n{tag} OK [READ-WRITE] selected\r\n")),
+                ("SEARCH", Some("* SEARCH 2 4 5\r\n{tag} OK\r\n")),
+                ("IDLE", Some("+ idling\r\n")),
+            ],
+        ]);
+
+        let rx = monitor(account, NOOP_INTERVAL);
+
+        assert_eq!(next_status(&rx), Some(1));
+        assert_eq!(next_status(&rx), Some(2));
+
+        // the hangup, then a reconnect after the first backoff
+        assert_eq!(next_status(&rx), None);
+        assert_eq!(next_status(&rx), Some(3));
+    }
+
+    #[test]
+    fn monitor_polls_with_noop_without_idle() {
+        let account = serve(vec![vec![
+            ("LOGIN", Some("{tag} OK logged in\r\n")),
+            ("CAPABILITY", Some("* CAPABILITY IMAP4rev1\r\n{tag} OK\r\n")),
+            ("SELECT", Some("* 3 EXISTS\r\n{tag} OK [READ-WRITE] selected\r\n")),
+            ("SEARCH", Some("* SEARCH\r\n{tag} OK\r\n")),
+            ("NOOP", Some("* 4 EXISTS\r\n{tag} OK\r\n")),
+            ("FETCH", Some("* 4 FETCH (FLAGS ())\r\n{tag} OK\r\n")),
+            ("NOOP", Some("* 4 FETCH (FLAGS (\\Seen))\r\n{tag} OK\r\n")),
+        ]]);
+
+        let rx = monitor(account, Duration::from_millis(50));
+
+        assert_eq!(next_status(&rx), Some(0));
+        assert_eq!(next_status(&rx), Some(1));
+        assert_eq!(next_status(&rx), Some(0));
+    }
+
+    #[test]
+    fn backoff_doubles_up_to_the_cap() {
+        let mut conn = Connector::new(Plain, None);
+        let mut max = BACKOFF_MIN;
+
+        for _ in 0..12 {
+            let delay = conn.backoff();
+            assert!(delay >= max / 2 && delay <= max, "{:?} not within {:?}", delay, max);
+            max = (max * 2).min(BACKOFF_MAX);
+        }
+    }
+}
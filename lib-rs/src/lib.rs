@@ -22,6 +22,8 @@ mod ffi {
             -> *mut ModulePtr;
         pub fn my3status_output_begin(m: *mut ModulePtr);
         pub fn my3status_output_done(m: *mut ModulePtr);
+        pub fn my3status_count_reconnect(m: *mut ModulePtr);
+        pub fn my3status_count_resumed(m: *mut ModulePtr);
     }
 
 }
@@ -38,6 +40,8 @@ impl State {
     }
 }
 
+// clones share the module; the core locks or uses atomics for all of it
+#[derive(Clone)]
 pub struct Module { ptr: *mut ffi::ModulePtr }
 
 impl Module {
@@ -47,8 +51,21 @@ impl Module {
         unsafe { ffi::my3status_output_done(self.ptr) }
     }
 
+    // goes through the output lock like any other change, or the bar
+    // never notices; only this module's threads write it, so checking
+    // first is safe
     pub fn visible(&self, v: bool) {
-        unsafe { (*self.ptr).output_visible = v }
+        if unsafe { (*self.ptr).output_visible } == v { return }
+
+        self.with_output_lock(|| unsafe { (*self.ptr).output_visible = v });
+    }
+
+    pub fn count_reconnect(&self) {
+        unsafe { ffi::my3status_count_reconnect(self.ptr) }
+    }
+
+    pub fn count_resumed(&self) {
+        unsafe { ffi::my3status_count_resumed(self.ptr) }
     }
 }
 
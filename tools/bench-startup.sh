@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+#
+# Measures how long my3status takes to print its first status line, and how
+# much memory it holds at that point.
+#
+# usage: bench-startup.sh BINARY MODULE...
+
+set -euo pipefail
+
+RUNS=${RUNS:-20}
+# seconds to wait for the first frame before giving up
+TIMEOUT=${TIMEOUT:-10}
+
+bin=$1
+shift
+
+total_us=0
+total_rss=0
+
+for ((i = 0; i < RUNS; i++)); do
+	start=$(date +%s%N)
+
+	coproc M { exec "$bin" "$@" 2>/dev/null; }
+	pid=$M_PID
+
+	# after the header, {"version":1} and a lone [, every line is a
+	# frame, which is [] while all modules are hidden
+	frame=0
+	while read -r -t "$TIMEOUT" line <&"${M[0]}"; do
+		case $line in
+		"[") ;;
+		"["*) frame=1; break ;;
+		esac
+	done
+
+	end=$(date +%s%N)
+
+	if ((frame == 0)); then
+		echo "no frame from $bin within ${TIMEOUT}s" >&2
+		kill "$pid" 2>/dev/null || true
+		exit 1
+	fi
+	rss=$(awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status")
+
+	kill "$pid"
+	wait "$pid" 2>/dev/null || true
+
+	total_us=$((total_us + (end - start) / 1000))
+	total_rss=$((total_rss + rss))
+done
+
+echo "modules:           $*"
+echo "first frame after: $((total_us / RUNS / 1000)).$(printf %03d $((total_us / RUNS % 1000))) ms"
+echo "rss:               $((total_rss / RUNS)) kB"
@@ -0,0 +1,118 @@
+#!/usr/bin/env bash
+#
+# Checks the net module against a veth pair in a network namespace of its
+# own: links going down and up, a resync after the kernel drops events, and
+# the counter timer staying disarmed while every link is down.
+#
+# usage: test-net.sh BINARY
+#
+# Needs root for the namespace.
+
+set -euo pipefail
+shopt -s extglob
+
+FLIPS=${FLIPS:-1000}
+
+bin=$(realpath "$1")
+
+# the namespace, and every link in it, goes away when the script exits
+if [[ ${TEST_NET_NETNS:-} != 1 ]]; then
+	TEST_NET_NETNS=1 exec unshare --net "$0" "$bin"
+fi
+
+tmp=$(mktemp -d)
+pid=
+trap '[[ -n $pid ]] && kill "$pid" 2>/dev/null; rm -rf "$tmp"' EXIT
+
+rates='↓+([0-9.])[BKMGT] ↑+([0-9.])[BKMGT]'
+
+fail() {
+	echo "FAIL: $*" >&2
+	echo "last frame: $(tail -n 1 "$tmp/out")" >&2
+	exit 1
+}
+
+# waits up to two seconds for a frame whose text matches the glob $1
+expect() {
+	for ((i = 0; i < 20; i++)); do
+		# shellcheck disable=SC2053
+		if [[ $(tail -n 1 "$tmp/out") == *'"full_text":"🌐 '$1'"'* ]]; then
+			echo "ok: $2"
+			return
+		fi
+
+		sleep 0.1
+	done
+
+	fail "$2: wanted \"🌐 $1\""
+}
+
+# net is the only module running, so every timerfd in the process is its own
+timer_armed() {
+	local fd
+	for fd in /proc/"$pid"/fd/*; do
+		[[ $(readlink "$fd") == *timerfd* ]] || continue
+
+		if ! grep -q '^it_value: (0, 0)' /proc/"$pid"/fdinfo/"${fd##*/}"; then
+			return 0
+		fi
+	done
+
+	return 1
+}
+
+# events the kernel dropped on sockets subscribed to link and address changes
+dropped_events() {
+	awk '$2 == 0 && $4 == "00000111" { n += $9 } END { print n + 0 }' \
+		/proc/net/netlink
+}
+
+ip link set lo up
+ip link add t0 type veth peer name t1
+ip addr add 10.9.0.1/24 dev t0
+ip link set t0 up
+ip link set t1 up
+
+MY3STATUS_NET_INTERVAL=1 XDG_RUNTIME_DIR=$tmp \
+	"$bin" net >"$tmp/out" 2>"$tmp/err" &
+pid=$!
+
+expect "t0 $rates" "link up at startup"
+timer_armed || fail "timer not armed with t0 up"
+
+# t0 loses its carrier with its peer
+ip link set t1 down
+expect "down" "link down"
+timer_armed && fail "timer still armed with every link down"
+echo "ok: timer disarmed"
+
+ip link set t1 up
+expect "t0 $rates" "link back up"
+timer_armed || fail "timer not armed again with t0 up"
+
+# with the module stopped, the events overflow its socket. the last ones,
+# which replace t0 with t2, are dropped, so only a resync shows t2.
+kill -STOP "$pid"
+
+for ((i = 0; i < FLIPS; i++)); do
+	echo "link set t1 down"
+	echo "link set t1 up"
+done | ip -batch -
+
+ip link del t0
+ip link add t2 type veth peer name t3
+ip addr add 10.9.1.1/24 dev t2
+ip link set t2 up
+ip link set t3 up
+
+(($(dropped_events) > 0)) || fail "no events dropped; raise FLIPS"
+
+kill -CONT "$pid"
+expect "t2 $rates" "resync after ENOBUFS"
+
+ip link set t3 down
+expect "down" "every link down after the resync"
+timer_armed && fail "timer still armed after the resync"
+echo "ok: timer disarmed after the resync"
+
+kill -0 "$pid" 2>/dev/null || fail "my3status exited: $(cat "$tmp/err")"
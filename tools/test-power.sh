@@ -0,0 +1,144 @@
+#!/usr/bin/env bash
+#
+# Checks the power module against a fake power_supply tree: synthetic
+# uevents for changes and for supplies coming and going, and the fallback
+# that rereads the tree on a schedule of its own while unrelated uevents
+# keep arriving.
+#
+# usage: test-power.sh BINARY
+#
+# Needs root for the network namespace the uevents are sent in, and python3
+# to send them.
+
+set -euo pipefail
+
+INTERVAL=2
+
+bin=$(realpath "$1")
+
+# uevents sent in here stay in here, away from udev
+if [[ ${TEST_POWER_NETNS:-} != 1 ]]; then
+	TEST_POWER_NETNS=1 exec unshare --net "$0" "$bin"
+fi
+
+tmp=$(mktemp -d)
+pid=
+noise=
+trap '[[ -n $noise ]] && kill "$noise" 2>/dev/null
+      [[ -n $pid ]] && kill "$pid" 2>/dev/null
+      rm -rf "$tmp"' EXIT
+
+supplies=$tmp/sys/class/power_supply
+
+fail() {
+	echo "FAIL: $*" >&2
+	echo "last frame: $(tail -n 1 "$tmp/out")" >&2
+	exit 1
+}
+
+last_frame() {
+	tail -n 1 "$tmp/out"
+}
+
+# waits up to $3 seconds (default one) for the power block to read $1
+expect() {
+	for ((i = 0; i < ${3:-1} * 10; i++)); do
+		if [[ $(last_frame) == *'"full_text":"'$1'"'* ]]; then
+			echo "ok: $2"
+			return
+		fi
+
+		sleep 0.1
+	done
+
+	fail "$2: wanted \"$1\""
+}
+
+# sends a kernel uevent: ACTION@DEVPATH, then KEY=VALUE pairs
+uevent() {
+	python3 -c '
+import socket, sys
+s = socket.socket(socket.AF_NETLINK, socket.SOCK_DGRAM, 15)
+s.sendto(b"".join(a.encode() + b"\0" for a in sys.argv[1:]), (0, 1))
+' "$@"
+}
+
+supply_event() {
+	uevent "$1@/devices/fake/power_supply/$2" "ACTION=$1" \
+		SUBSYSTEM=power_supply "POWER_SUPPLY_NAME=$2"
+}
+
+# writes in place, like sysfs, so the module's open fds see the change
+set_attr() {
+	echo "$3" >"$supplies/$1/$2"
+}
+
+add_battery() {
+	mkdir -p "$supplies/$1"
+	set_attr "$1" type Battery
+	set_attr "$1" capacity "$2"
+	set_attr "$1" status Discharging
+}
+
+add_battery BAT0 80
+mkdir -p "$supplies/AC"
+set_attr AC type Mains
+set_attr AC online 0
+
+MY3STATUS_SYSFS_ROOT=$tmp/sys MY3STATUS_POWER_INTERVAL=$INTERVAL \
+	XDG_RUNTIME_DIR=$tmp "$bin" power >"$tmp/out" 2>"$tmp/err" &
+pid=$!
+
+expect "🔋 80%" "battery at startup"
+
+set_attr BAT0 capacity 75
+supply_event change BAT0
+expect "🔋 75%" "change uevent"
+
+set_attr AC online 1
+supply_event change AC
+expect "🔌 75%" "mains plugged in"
+
+# a supply coming along is only picked up by a rescan
+add_battery BAT1 25
+supply_event add BAT1
+expect "🔌 50%" "add uevent rescans"
+
+# without a uevent, only the fallback notices. the first change it shows
+# tells where its schedule is.
+set_attr BAT0 capacity 55
+expect "🔌 40%" "fallback reread" $((INTERVAL + 1))
+fallback_at=$(($(date +%s%N) / 1000000 + INTERVAL * 1000))
+
+# unrelated uevents wake the module up, but neither count as a change nor
+# push the fallback back
+(while :; do
+	uevent "change@/devices/virtual/net/lo" ACTION=change SUBSYSTEM=net
+	sleep 0.2
+done) &
+noise=$!
+
+set_attr BAT1 capacity 35
+sleep 1
+[[ $(last_frame) == *'"full_text":"🔌 40%"'* ]] ||
+	fail "unrelated uevents triggered a reread"
+echo "ok: unrelated uevents ignored"
+
+expect "🔌 45%" "fallback on schedule despite unrelated uevents" 3
+late=$(($(date +%s%N) / 1000000 - fallback_at))
+((late < 500)) || fail "fallback ${late} ms late"
+
+kill "$noise"
+noise=
+
+# with no battery left, there is nothing to show
+rm -r "$supplies/BAT0" "$supplies/BAT1"
+supply_event remove BAT0
+for ((i = 0; i < 10; i++)); do
+	[[ $(last_frame) == *'"name":"power"'* ]] || break
+	sleep 0.1
+done
+[[ $(last_frame) != *'"name":"power"'* ]] || fail "still shown without batteries"
+echo "ok: hidden after the batteries are removed"
+
+kill -0 "$pid" 2>/dev/null || fail "my3status exited: $(cat "$tmp/err")"